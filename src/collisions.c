@@ -0,0 +1,604 @@
+/*
+ * GroundTraffic
+ *
+ * (c) Jonathan Harris 2013-2014
+ *
+ * Licensed under GNU LGPL v2.1.
+ */
+
+#include "groundtraffic.h"
+#include "bbox.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#  include <emmintrin.h>
+#  define USE_SSE2
+#endif
+
+/* A route path segment, from node to node+1 */
+typedef struct
+{
+    route_t *route;
+    int node;			/* Node at start of segment */
+    int shape;			/* Index of this segment's shape in shapes array */
+} segment_t;
+
+/* A unique path segment. Routes often share segments, so we test each shape pair once rather than once per
+ * route pair. */
+typedef struct
+{
+    loc_t *p0, *p1;		/* Start and end nodes of the first segment with this shape */
+    bbox_t bbox;
+    int mincol, maxcol, minrow, maxrow;	/* Range of grid cells covered by bbox */
+    int end;			/* Index of the location of p1 among the unique end node locations */
+} shape_t;
+
+/* Pair of colliding shapes - indices into shapes array */
+typedef struct
+{
+    int a, b;
+} hit_t;
+
+/* Uniform grid over the shapes' bboxes. Cells are sized in metres but indexed in lat/lon so that the
+ * broad phase is conservative with respect to the lat/lon tests that decide whether segments collide. */
+typedef struct
+{
+    float minlat, minlon;
+    float dlat, dlon;		/* Cell size [degrees] */
+    int cols, rows;		/* lon, lat */
+    int *start;			/* First entry in cells array for each cell, plus end marker */
+    int *cells;			/* Shape indices, grouped by cell */
+    /* Copies of shape data in the same order as cells, so the narrow phase can test several shapes at once */
+    float *lat0, *lon0, *lat1, *lon1;		/* Start and end nodes */
+    float *bminlat, *bmaxlat, *bminlon, *bmaxlon;	/* bbox */
+    int *minrow, *mincol;
+} grid_t;
+
+/* Thread that tests a share of the grid, collecting hits in private storage */
+typedef struct
+{
+    worker_t worker;		/* Must be first - worker_start() passes this to the thread */
+    int cell;			/* Tests grid cells cell, cell+ncolliders, ... */
+    hit_t *hits;
+    int nhits, maxhits;
+    int failed;			/* Ran out of memory */
+} collider_t;
+
+/* In this file */
+static segment_t *segments;
+static shape_t *shapes;		/* Shared read-only by colliders */
+static grid_t grid;
+static collider_t colliders[MAX_COLLIDERS];
+static int ncolliders;
+
+
+static inline int grid_col(grid_t *grid, float lon)
+{
+    int col = (int) ((lon - grid->minlon) / grid->dlon);
+    return col < 0 ? 0 : (col >= grid->cols ? grid->cols-1 : col);
+}
+
+static inline int grid_row(grid_t *grid, float lat)
+{
+    int row = (int) ((lat - grid->minlat) / grid->dlat);
+    return row < 0 ? 0 : (row >= grid->rows ? grid->rows-1 : row);
+}
+
+/* Inclusive bbox overlap. Superset of both bbox_intersect() and co-located end nodes. */
+static inline int bbox_touch(bbox_t *a, bbox_t *b)
+{
+    return ((a->minlat <= b->maxlat) && (b->minlat <= a->maxlat) &&
+            (a->minlon <= b->maxlon) && (b->minlon <= a->maxlon));
+}
+
+/* Enumerate path segments of routes that are subject to collisions. Returns segment count, or -1 on OOM */
+static int make_segments(airport_t *airport, segment_t **segmentsp)
+{
+    route_t *route;
+    segment_t *segments;
+    int count = 0, i;
+
+    for (route=airport->routes; route; route=route->next)
+        if (!route->parent && !route->highway)		/* Skip child routes and highways */
+            count += route->pathlen;
+    if (!(*segmentsp = segments = malloc((count ? count : 1) * sizeof(segment_t))))
+        return -1;
+
+    count = 0;
+    for (route=airport->routes; route; route=route->next)
+    {
+        if (route->parent || route->highway) continue;
+
+        for (i=0; i < route->pathlen; i++)
+        {
+            if (i+1 == route->pathlen && route->path[route->pathlen-1].flags.reverse)
+                break;	/* Reversible routes don't circle back */
+            segments[count].route = route;
+            segments[count].node = i;
+            count++;
+        }
+    }
+    return count;
+}
+
+
+static inline unsigned shape_hash(loc_t *p0, loc_t *p1)
+{
+    unsigned k[4], h = 2166136261u;	/* FNV-1a over the nodes' bit patterns */
+    int i;
+
+    memcpy(k,   &p0->lat, sizeof(float));
+    memcpy(k+1, &p0->lon, sizeof(float));
+    memcpy(k+2, &p1->lat, sizeof(float));
+    memcpy(k+3, &p1->lon, sizeof(float));
+    for (i=0; i<4; i++)
+        h = (h ^ k[i]) * 16777619u;
+    return h ^ (h >> 16);
+}
+
+
+/* Find the unique shapes among the segments. Returns shape count, or -1 on OOM */
+static int make_shapes(segment_t *segments, int count, shape_t **shapesp)
+{
+    shape_t *shapes;
+    int *table, size, nshapes = 0, i;
+
+    if (!(*shapesp = shapes = malloc((count ? count : 1) * sizeof(shape_t))))
+        return -1;
+    for (size = 64; size < 2 * count; size *= 2);
+    if (!(table = malloc(size * sizeof(int))))
+        return -1;
+    memset(table, -1, size * sizeof(int));
+
+    for (i=0; i<count; i++)
+    {
+        segment_t *segment = segments + i;
+        route_t *route = segment->route;
+        loc_t *p0 = &route->path[segment->node].waypoint;
+        loc_t *p1 = &route->path[segment->node+1 == route->pathlen ? 0 : segment->node+1].waypoint;
+        unsigned slot = shape_hash(p0, p1) & (size-1);
+
+        /* Linear probe for an identical shape */
+        while (table[slot] >= 0)
+        {
+            shape_t *shape = shapes + table[slot];
+            if (shape->p0->lat == p0->lat && shape->p0->lon == p0->lon && shape->p1->lat == p1->lat && shape->p1->lon == p1->lon)
+                break;
+            slot = (slot + 1) & (size-1);
+        }
+
+        if (table[slot] < 0)
+        {
+            shape_t *shape = shapes + nshapes;
+            shape->p0 = p0;
+            shape->p1 = p1;
+            bbox_init(&shape->bbox);
+            bbox_add(&shape->bbox, p0->lat, p0->lon);
+            bbox_add(&shape->bbox, p1->lat, p1->lon);
+            table[slot] = nshapes++;
+        }
+        segment->shape = table[slot];
+    }
+    free(table);
+    return nshapes;
+}
+
+
+/* Bin shapes into grid cells. Returns 0 on OOM */
+static int make_grid(grid_t *grid, shape_t *shapes, int count)
+{
+    bbox_t bounds;
+    float coslat, extent = 0;
+    int i, n, col, row, cellcount;
+
+    bbox_init(&bounds);
+    for (i=0; i<count; i++)
+    {
+        bbox_add(&bounds, shapes[i].bbox.minlat, shapes[i].bbox.minlon);
+        bbox_add(&bounds, shapes[i].bbox.maxlat, shapes[i].bbox.maxlon);
+    }
+    coslat = cosf(D2R((bounds.minlat + bounds.maxlat) / 2));
+
+    /* Size cells to typical segment length, so that long segments don't get tested repeatedly in many cells */
+    for (i=0; i<count; i++)
+    {
+        float dlat = shapes[i].bbox.maxlat - shapes[i].bbox.minlat;
+        float dlon = (shapes[i].bbox.maxlon - shapes[i].bbox.minlon) * coslat;
+        extent += dlat > dlon ? dlat : dlon;
+    }
+    extent /= count;
+
+    grid->minlat = bounds.minlat;
+    grid->minlon = bounds.minlon;
+    grid->dlat = COLLISION_CELL / (RADIUS * (float) (M_PI/180));
+    if (grid->dlat < extent) grid->dlat = extent;
+    grid->dlon = grid->dlat / coslat;
+    if ((bounds.maxlat - bounds.minlat) / grid->dlat >= COLLISION_MAXCELLS)
+        grid->dlat = (bounds.maxlat - bounds.minlat) / (COLLISION_MAXCELLS-1);
+    if ((bounds.maxlon - bounds.minlon) / grid->dlon >= COLLISION_MAXCELLS)
+        grid->dlon = (bounds.maxlon - bounds.minlon) / (COLLISION_MAXCELLS-1);
+    grid->rows = 1 + (int) ((bounds.maxlat - bounds.minlat) / grid->dlat);
+    grid->cols = 1 + (int) ((bounds.maxlon - bounds.minlon) / grid->dlon);
+    cellcount = grid->rows * grid->cols;
+
+    if (!(grid->start = calloc(cellcount + 1, sizeof(int))))
+        return 0;
+
+    /* Count shapes in each cell */
+    for (i=0; i<count; i++)
+    {
+        shape_t *shape = shapes + i;
+        shape->mincol = grid_col(grid, shape->bbox.minlon);
+        shape->maxcol = grid_col(grid, shape->bbox.maxlon);
+        shape->minrow = grid_row(grid, shape->bbox.minlat);
+        shape->maxrow = grid_row(grid, shape->bbox.maxlat);
+        for (row = shape->minrow; row <= shape->maxrow; row++)
+            for (col = shape->mincol; col <= shape->maxcol; col++)
+                grid->start[row * grid->cols + col + 1]++;
+    }
+
+    /* Prefix sum, then fill. Shapes in each cell end up in ascending order. */
+    for (i=0; i<cellcount; i++)
+        grid->start[i+1] += grid->start[i];
+    n = grid->start[cellcount] + 3;	/* Pad so that four-wide loads can overrun the last cell */
+    if (!(grid->cells = calloc(n, 11 * sizeof(int))))
+        return 0;
+    grid->lat0    = (float *) (grid->cells + n);
+    grid->lon0    = (float *) (grid->cells + n*2);
+    grid->lat1    = (float *) (grid->cells + n*3);
+    grid->lon1    = (float *) (grid->cells + n*4);
+    grid->bminlat = (float *) (grid->cells + n*5);
+    grid->bmaxlat = (float *) (grid->cells + n*6);
+    grid->bminlon = (float *) (grid->cells + n*7);
+    grid->bmaxlon = (float *) (grid->cells + n*8);
+    grid->minrow  = grid->cells + n*9;
+    grid->mincol  = grid->cells + n*10;
+    for (i=0; i<count; i++)
+    {
+        shape_t *shape = shapes + i;
+
+        for (row = shape->minrow; row <= shape->maxrow; row++)
+            for (col = shape->mincol; col <= shape->maxcol; col++)
+            {
+                int k = grid->start[row * grid->cols + col]++;
+                grid->cells[k]   = i;
+                grid->lat0[k]    = shape->p0->lat;
+                grid->lon0[k]    = shape->p0->lon;
+                grid->lat1[k]    = shape->p1->lat;
+                grid->lon1[k]    = shape->p1->lon;
+                grid->bminlat[k] = shape->bbox.minlat;
+                grid->bmaxlat[k] = shape->bbox.maxlat;
+                grid->bminlon[k] = shape->bbox.minlon;
+                grid->bmaxlon[k] = shape->bbox.maxlon;
+                grid->minrow[k]  = shape->minrow;
+                grid->mincol[k]  = shape->mincol;
+            }
+    }
+    for (i=cellcount; i>0; i--)
+        grid->start[i] = grid->start[i-1];	/* Undo the increments */
+    grid->start[0] = 0;
+
+    return -1;
+}
+
+
+/* Narrow phase. Co-located end nodes or intersecting segments = Collision. */
+static inline int collide(shape_t *a, shape_t *b)
+{
+    return (a->p1->lat == b->p1->lat && a->p1->lon == b->p1->lon) ||
+        ((bbox_intersect(&a->bbox, &b->bbox) || bbox_intersect(&b->bbox, &a->bbox)) && loc_intersect(a->p0, a->p1, b->p0, b->p1));
+}
+
+
+/* Record a hit. Returns 0 on OOM */
+static inline int collider_add(collider_t *collider, int a, int b)
+{
+    if (collider->nhits >= collider->maxhits)
+    {
+        hit_t *newhits;
+        collider->maxhits = collider->maxhits ? collider->maxhits * 2 : 1024;
+        if (!(newhits = realloc(collider->hits, collider->maxhits * sizeof(hit_t))))
+        {
+            collider->failed = -1;
+            return 0;
+        }
+        collider->hits = newhits;
+    }
+    collider->hits[collider->nhits].a = a;
+    collider->hits[collider->nhits].b = b;
+    collider->nhits++;
+    return -1;
+}
+
+
+#ifdef USE_SSE2
+
+/* Test grid entry i against the four grid entries starting at j, which must be in the same cell.
+ * Does the broad phase tests and a division-free version of collide()'s tests. The compiler is free to
+ * replace vector division with an approximation, so this is only a necessary condition and the caller must
+ * confirm each candidate with collide(). Returns a bitmask of candidates. */
+static inline int collide4(int i, int j, int end, int row, int col)
+{
+    __m128i mask;
+    __m128 fmask, s1_x, s1_y, s2_x, s2_y, dx, dy, d, s, t, zero = _mm_setzero_ps(), sign = _mm_set1_ps(-0.f);
+    __m128 lat0 = _mm_set1_ps(grid.lat0[i]), lon0 = _mm_set1_ps(grid.lon0[i]);
+    __m128 lat1 = _mm_set1_ps(grid.lat1[i]), lon1 = _mm_set1_ps(grid.lon1[i]);
+    __m128 minlat = _mm_set1_ps(grid.bminlat[i]), maxlat = _mm_set1_ps(grid.bmaxlat[i]);
+    __m128 minlon = _mm_set1_ps(grid.bminlon[i]), maxlon = _mm_set1_ps(grid.bmaxlon[i]);
+    __m128 bminlat = _mm_loadu_ps(grid.bminlat + j), bmaxlat = _mm_loadu_ps(grid.bmaxlat + j);
+    __m128 bminlon = _mm_loadu_ps(grid.bminlon + j), bmaxlon = _mm_loadu_ps(grid.bmaxlon + j);
+    __m128 blat0 = _mm_loadu_ps(grid.lat0 + j), blon0 = _mm_loadu_ps(grid.lon0 + j);
+    __m128 blat1 = _mm_loadu_ps(grid.lat1 + j), blon1 = _mm_loadu_ps(grid.lon1 + j);
+
+    /* Broad phase: in this cell, and only in the cell containing the corner of the overlap.
+     * Both shapes are in this cell so max(a->minrow, b->minrow) == row iff either minrow == row. */
+    mask = _mm_cmplt_epi32(_mm_add_epi32(_mm_set1_epi32(j), _mm_set_epi32(3, 2, 1, 0)), _mm_set1_epi32(end));
+    if (grid.minrow[i] != row)
+        mask = _mm_and_si128(mask, _mm_cmpeq_epi32(_mm_loadu_si128((__m128i *) (grid.minrow + j)), _mm_set1_epi32(row)));
+    if (grid.mincol[i] != col)
+        mask = _mm_and_si128(mask, _mm_cmpeq_epi32(_mm_loadu_si128((__m128i *) (grid.mincol + j)), _mm_set1_epi32(col)));
+    fmask = _mm_and_ps(_mm_castsi128_ps(mask),
+                       _mm_and_ps(_mm_and_ps(_mm_cmple_ps(minlat, bmaxlat), _mm_cmple_ps(bminlat, maxlat)),
+                                  _mm_and_ps(_mm_cmple_ps(minlon, bmaxlon), _mm_cmple_ps(bminlon, maxlon))));
+    if (!_mm_movemask_ps(fmask)) return 0;
+
+    /* loc_intersect(p0, p1, p2, p3). 0 < n/d < 1 requires 0 < n*sign(d) < |d| */
+    s1_x = _mm_sub_ps(lon1, lon0);  s1_y = _mm_sub_ps(lat1, lat0);
+    s2_x = _mm_sub_ps(blon1, blon0);  s2_y = _mm_sub_ps(blat1, blat0);
+    d = _mm_add_ps(_mm_mul_ps(_mm_xor_ps(s2_x, sign), s1_y), _mm_mul_ps(s1_x, s2_y));
+    dx = _mm_sub_ps(lon0, blon0);
+    dy = _mm_sub_ps(lat0, blat0);
+    s = _mm_add_ps(_mm_mul_ps(_mm_xor_ps(s1_y, sign), dx), _mm_mul_ps(s1_x, dy));
+    s = _mm_xor_ps(s, _mm_and_ps(d, sign));
+    dx = _mm_sub_ps(_mm_mul_ps(s2_x, dy), _mm_mul_ps(s2_y, dx));	/* t's numerator */
+    dx = _mm_xor_ps(dx, _mm_and_ps(d, sign));
+    d = _mm_andnot_ps(sign, d);
+    t = _mm_and_ps(_mm_and_ps(_mm_cmpgt_ps(s, zero), _mm_cmplt_ps(s, d)),
+                   _mm_and_ps(_mm_cmpgt_ps(dx, zero), _mm_cmplt_ps(dx, d)));
+
+    /* or co-located end nodes */
+    t = _mm_or_ps(t, _mm_and_ps(_mm_cmpeq_ps(lat1, blat1), _mm_cmpeq_ps(lon1, blon1)));
+
+    return _mm_movemask_ps(_mm_and_ps(fmask, t));
+}
+
+#endif /* USE_SSE2 */
+
+
+/* Test all shape pairs in our share of the grid cells */
+static void *collide_cells(void *arg)
+{
+    collider_t *collider = arg;
+    int cell, i, j;
+
+    for (cell = collider->cell; cell < grid.rows * grid.cols; cell += ncolliders)
+    {
+        int row = cell / grid.cols, col = cell % grid.cols;
+        int end = grid.start[cell+1];
+
+        MemoryBarrier();
+        if (collision_worker.die_please) goto stop;
+
+        for (i = grid.start[cell]; i < end; i++)
+        {
+#ifdef USE_SSE2
+            for (j = i+1; j < end; j += 4)
+            {
+                int k, mask = collide4(i, j, end, row, col);
+
+                for (k = 0; mask; k++, mask >>= 1)
+                    if ((mask & 1) &&
+                        collide(shapes + grid.cells[i], shapes + grid.cells[j+k]) &&
+                        !collider_add(collider, grid.cells[i], grid.cells[j+k]))
+                        goto stop;
+            }
+#else
+            shape_t *a = shapes + grid.cells[i];
+
+            for (j = i+1; j < end; j++)
+            {
+                shape_t *b = shapes + grid.cells[j];
+
+                if (!bbox_touch(&a->bbox, &b->bbox))
+                    continue;
+
+                /* Only test a pair in the cell containing the bottom-left corner of their overlap */
+                if (row != (a->minrow > b->minrow ? a->minrow : b->minrow) ||
+                    col != (a->mincol > b->mincol ? a->mincol : b->mincol) ||
+                    !collide(a, b))
+                    continue;
+
+                if (!collider_add(collider, grid.cells[i], grid.cells[j]))
+                    goto stop;
+            }
+#endif
+        }
+    }
+
+stop:
+    worker_has_finished(&collider->worker);
+    return NULL;
+}
+
+
+/* Find the unique locations of the shapes' end nodes. Returns location count, or -1 on OOM */
+static int make_ends(shape_t *shapes, int count)
+{
+    int *table, size, nends = 0, i;
+
+    for (size = 64; size < 2 * count; size *= 2);
+    if (!(table = malloc(size * sizeof(int))))
+        return -1;
+    memset(table, -1, size * sizeof(int));
+
+    for (i=0; i<count; i++)
+    {
+        loc_t *p1 = shapes[i].p1;
+        unsigned slot = shape_hash(p1, p1) & (size-1);
+
+        /* Linear probe for a shape with a co-located end node */
+        while (table[slot] >= 0 && (shapes[table[slot]].p1->lat != p1->lat || shapes[table[slot]].p1->lon != p1->lon))
+            slot = (slot + 1) & (size-1);
+
+        if (table[slot] < 0)
+        {
+            table[slot] = i;
+            shapes[i].end = nends++;
+        }
+        else
+        {
+            shapes[i].end = shapes[table[slot]].end;
+        }
+    }
+    free(table);
+    return nends;
+}
+
+
+/* Check for collisions.
+ * Identical segments are merged into shapes, and only shape pairs that share a grid cell are tested, so cost is
+ * roughly linear in the number of unique segments. The grid cells are shared out between a pool of colliders, one
+ * per processor.
+ *
+ * The result is a set of conflict zones - one for each shape, followed by one for each unique end node location -
+ * which routes reserve as they move. Each shape's zone lists the shape zones that it collides with. */
+void *check_collisions(void *arg)
+{
+    route_t *route;
+    zone_t *zones = NULL;
+    int *conflicts = NULL;
+    int count, nshapes = 0, nends, nconflicts, n, i;
+#ifdef DO_BENCHMARK
+    char buffer[128];
+    struct timeval t1, t2;
+    gettimeofday(&t1, NULL);		/* start */
+#endif
+
+    ncolliders = 0;
+    memset(&grid, 0, sizeof(grid));
+    if ((count = make_segments(&airport, &segments)) < 0 ||
+        (nshapes = make_shapes(segments, count, &shapes)) < 0 ||
+        (nshapes && !make_grid(&grid, shapes, nshapes)))
+    {
+        xplog("Out of memory!");
+        goto done;
+    }
+
+    if (nshapes)
+    {
+        ncolliders = cpu_count();
+        if (ncolliders > MAX_COLLIDERS) ncolliders = MAX_COLLIDERS;
+        if (ncolliders > grid.rows * grid.cols) ncolliders = grid.rows * grid.cols;
+        for (n=0; n<ncolliders; n++)
+        {
+            colliders[n].cell = n;
+            colliders[n].hits = NULL;
+            colliders[n].nhits = colliders[n].maxhits = 0;
+            colliders[n].failed = 0;
+        }
+
+        /* This thread does the first share */
+        for (n=1; n<ncolliders; n++)
+            if (!worker_start(&colliders[n].worker, collide_cells))
+                collide_cells(colliders + n);	/* Do it ourselves */
+        collide_cells(colliders);
+        for (n=1; n<ncolliders; n++)
+            worker_wait(&colliders[n].worker);
+
+        MemoryBarrier();
+        if (collision_worker.die_please) goto stop;
+    }
+
+    /* Count each shape's conflicts. Every shape conflicts with itself in case it's used by more than one route. */
+    if ((nends = make_ends(shapes, nshapes)) < 0 ||
+        !(zones = calloc(nshapes + nends + 1, sizeof(zone_t))))
+    {
+        xplog("Out of memory!");
+        goto done;
+    }
+    for (i=0; i<nshapes; i++)
+        zones[i].conflict_count = 1;
+    for (n=0; n<ncolliders; n++)
+    {
+        collider_t *collider = colliders + n;
+
+        if (collider->failed)
+        {
+            xplog("Out of memory!");
+            goto done;
+        }
+        for (i=0; i<collider->nhits; i++)
+        {
+            zones[collider->hits[i].a].conflict_count++;
+            zones[collider->hits[i].b].conflict_count++;
+        }
+    }
+
+    /* Carve out each shape's slice, then fill */
+    for (i=0, nconflicts=0; i<nshapes; i++)
+        nconflicts += zones[i].conflict_count;
+    if (!(conflicts = malloc((nconflicts ? nconflicts : 1) * sizeof(int))))
+    {
+        xplog("Out of memory!");
+        goto done;
+    }
+    for (i=0, nconflicts=0; i<nshapes; i++)
+    {
+        zones[i].conflicts = conflicts + nconflicts;
+        nconflicts += zones[i].conflict_count;
+        zones[i].conflicts[0] = i;
+        zones[i].conflict_count = 1;
+    }
+    for (n=0; n<ncolliders; n++)
+    {
+        collider_t *collider = colliders + n;
+        for (i=0; i<collider->nhits; i++)
+        {
+            zone_t *a = zones + collider->hits[i].a, *b = zones + collider->hits[i].b;
+            a->conflicts[a->conflict_count++] = collider->hits[i].b;
+            b->conflicts[b->conflict_count++] = collider->hits[i].a;
+        }
+        free(collider->hits);
+        collider->hits = NULL;
+    }
+
+    /* Tell route nodes which zones they're in. Nodes of routes that aren't subject to collisions aren't in any. */
+    for (route=airport.routes; route; route=route->next)
+        for (i=0; i < route->pathlen; i++)
+            route->path[i].segment_zone = route->path[i].node_zone = -1;
+    for (i=0; i<count; i++)
+    {
+        segment_t *segment = segments + i;
+        path_t *path = segment->route->path;
+        path[segment->node].segment_zone = segment->shape;
+        path[segment->node+1 == segment->route->pathlen ? 0 : segment->node+1].node_zone = nshapes + shapes[segment->shape].end;
+    }
+    airport.zones = zones;
+    airport.conflicts = conflicts;
+    zones = NULL;
+    conflicts = NULL;
+
+#ifdef DO_BENCHMARK
+    gettimeofday(&t2, NULL);		/* stop */
+    sprintf(buffer, "%d us in activate check collisions (%d threads, %d/%d unique segments, %d conflicts)", (int) ((t2.tv_sec-t1.tv_sec) * 1000000 + t2.tv_usec - t1.tv_usec), ncolliders, nshapes, count, nconflicts);
+    xplog(buffer);
+#endif
+
+done:
+    worker_has_finished(&collision_worker);
+stop:
+    for (n=0; n<ncolliders; n++)
+    {
+        free(colliders[n].hits);
+        colliders[n].hits = NULL;
+    }
+    free(conflicts);
+    free(zones);
+    free(grid.cells);	/* Also frees the other per-entry arrays */
+    free(grid.start);
+    free(shapes);
+    free(segments);
+    grid.cells = grid.start = NULL;
+    shapes = NULL;
+    segments = NULL;
+    return NULL;
+}
@@ -11,9 +11,19 @@
 
 /* Globals */
 route_t *drawroute = NULL;	/* Global so can be accessed in DataRef callback */
-float last_frame=0;		/* last time we recalculated */
-static int is_night=0;		/* was night last time we recalculated? */
-float lod_factor;		/* screen_width / lod_bias at time of last draw */
+float last_frame=0;		/* last time we simulated */
+static float prev_frame=0;	/* time we simulated before that */
+static float next_sim=0;	/* when we're next due to simulate */
+static int is_night=0;		/* was night last time we simulated? */
+float lod_factor;		/* screen_width / lod_bias at time of last simulation step or draw */
+float drawlag = 0;		/* how far [s] drawing positions in this frame lag the last simulation step */
+static point_t last_view;	/* view position and lod_factor last time we simulated */
+static float last_lod_factor;
+static int ndistant = 0;	/* number of routes beyond draw range last time we simulated */
+static unsigned int stepcount = 0;	/* number of times we've simulated, for staggering reduced rate calculations */
+static float interpolated_time = 0;	/* time and step for which drawing positions were last interpolated */
+static unsigned int interpolated_step = 0;
+static float drawn_time = 0;	/* time at last normal (i.e. not shadow) draw, to tell whether the sim is paused */
 int font_width, font_semiheight;
 char *labeltbl = NULL;
 #ifdef DO_BENCHMARK
@@ -21,91 +31,887 @@ int drawcumul  = 0;		/* clock time taken drawing [us] */
 int drawframes = 0;		/* over cumulative number of frames */
 #endif
 
+/* Thread that calculates drawing positions for a share of the moving routes while the main thread does the first share */
+typedef struct
+{
+    worker_t worker;		/* Must be first - worker_start() passes this to the thread */
+    event_t go, done;		/* Start of work in this frame, and its completion */
+    route_t **routes;		/* Calculates count routes from this part of airport.moving */
+    int count;
+} drawer_t;
+
 /* In this file */
-static void bez(XPLMDrawInfo_t *drawinfo, point_t *p1, point_t *p2, point_t *p3, float mu);
+static drawer_t drawers[MAX_DRAWERS];
+static int ndrawers = 0;	/* Number of running drawers */
 
+static void calcpositions(route_t **routes, int count);
 
-static collision_t* iscollision(route_t *route, int tryno)
+
+/* Mark the grid cells that aircraft are in in this frame. Aircraft footprints are projected as far ahead as the
+ * longest time that a route takes to traverse a segment, so iscollision() can skip any segment in unmarked cells. */
+static void nearplanes()
+{
+    segmentgrid_t *grid = &airport.segmentgrid;
+    int planeno;
+
+    if (grid->marked == last_frame) return;
+    grid->marked = last_frame;
+
+    for (planeno=0; planeno<count_footprints(); planeno++)
+    {
+        point_t *p;
+        float minx = FLT_MAX, minz = FLT_MAX, maxx = -FLT_MAX, maxz = -FLT_MAX;
+        int i, k, col, row, mincol, maxcol, minrow, maxrow;
+
+        if (!(p = get_plane_footprint(planeno, 0))) continue;	/* Airborne */
+        for (k=0; k<2; k++)
+        {
+            for (i=0; i<4; i++)
+            {
+                if (p[i].x < minx) minx = p[i].x;
+                if (p[i].x > maxx) maxx = p[i].x;
+                if (p[i].z < minz) minz = p[i].z;
+                if (p[i].z > maxz) maxz = p[i].z;
+            }
+            p = get_plane_footprint(planeno, grid->maxtime);
+        }
+
+        mincol = (int) floorf((minx - grid->minx) / grid->size);
+        maxcol = (int) floorf((maxx - grid->minx) / grid->size);
+        minrow = (int) floorf((minz - grid->minz) / grid->size);
+        maxrow = (int) floorf((maxz - grid->minz) / grid->size);
+        if (maxcol < 0 || mincol >= grid->cols || maxrow < 0 || minrow >= grid->rows)
+            continue;	/* Nowhere near any route */
+        if (mincol < 0) mincol = 0;
+        if (maxcol >= grid->cols) maxcol = grid->cols-1;
+        if (minrow < 0) minrow = 0;
+        if (maxrow >= grid->rows) maxrow = grid->rows-1;
+
+        for (row = minrow; row <= maxrow; row++)
+            for (col = mincol; col <= maxcol; col++)
+                grid->plane_time[row * grid->cols + col] = last_frame;
+    }
+}
+
+
+/* Whether any aircraft is in a grid cell covered by the segment from p1 to p2 in this frame */
+static int isnearplane(point_t *p1, point_t *p2)
+{
+    segmentgrid_t *grid = &airport.segmentgrid;
+    int col, row;
+    int mincol = (int) (((p1->x < p2->x ? p1->x : p2->x) - grid->minx) / grid->size);
+    int maxcol = (int) (((p1->x > p2->x ? p1->x : p2->x) - grid->minx) / grid->size);
+    int minrow = (int) (((p1->z < p2->z ? p1->z : p2->z) - grid->minz) / grid->size);
+    int maxrow = (int) (((p1->z > p2->z ? p1->z : p2->z) - grid->minz) / grid->size);
+
+    nearplanes();
+    for (row = minrow; row <= maxrow; row++)
+        for (col = mincol; col <= maxcol; col++)
+            if (grid->plane_time[row * grid->cols + col] == last_frame)
+                return -1;
+    return 0;
+}
+
+
+/* Admission check for the segment we're about to enter. Returns the route that we have to wait for, or -1 for a plane. */
+static route_t* iscollision(route_t *route, int check_routes)
 {
     path_t *last_node = route->path + route->last_node;
     path_t *next_node = route->path + route->next_node;
-    collision_t *c = tryno ? (route->direction>0 ? last_node->collisions : next_node->collisions) : NULL;
-    int planeno;
+    path_t *c_node = route->direction>0 ? last_node : next_node;	/* Node at start of our segment (assuming forwards direction) */
+    reservation_t *r;
+    int n, planeno;
     float t = route->next_distance / route->speed;	/* time to next waypoint */;
+    float arrival = route->next_time + t;	/* Our next_time hasn't yet been updated yet so ~= now */
 
     if (route->highway) return NULL;	/* Highways aren't subject to collisions */
+    if (!airport.zones) check_routes = 0;	/* check_collisions() failed or hasn't finished */
+
+    if (check_routes && route->direction>0 && next_node->node_zone >= 0)
+    {
+        /* Co-located end nodes. Have to wait if another route is waiting at our next node, or will wait when
+         * it gets there, or if we'll get there too early. We don't check whether he *might* wait for a collision. */
+        for (r = airport.zones[next_node->node_zone].reservations; r; r = r->next)
+            if (r->route != route && arrival <= r->to)
+            {
+                if (r->to == FLT_MAX)
+                    route->collision_delay = COLLISION_TIMEOUT;	/* He'll wake us */
+                else
+                    route->collision_delay = COLLISION_INTERVAL;	/* Poll until we won't get there too early */
+                return r->route;
+            }
+    }
+
+    if (check_routes && c_node->segment_zone >= 0)
+    {
+        zone_t *zone = airport.zones + c_node->segment_zone;
+
+        /* Paths cross. Have to wait if another route is on a colliding segment.
+         * Routes that are waiting for any reason don't reserve segments. They'll re-check on exit from wait. */
+        for (n=0; n<zone->conflict_count; n++)
+            for (r = airport.zones[zone->conflicts[n]].reservations; r; r = r->next)
+            {
+                route_t *other = r->route;
+
+                if (other == route ||
+                    (route->direction>0 && other->direction>0 && next_node->node_zone == other->path[other->next_node].node_zone) ||	/* Co-located end nodes - see above */
+                    fabsf(other->drawinfo->y - route->drawinfo->y) > COLLISION_ALT)	/* At similar altitude? */
+                    continue;
+
+                route->collision_delay = COLLISION_TIMEOUT;	/* He'll wake us when he leaves the segment */
+                return other;
+            }
+    }
+
+    /* Plane collisions. Only need to test planes if any are near our segment. */
+    if (airport.segmentgrid.plane_time && !isnearplane(&last_node->p, &next_node->p))
+        return NULL;
+    for (planeno=0; planeno<count_footprints(); planeno++)
+    {
+        point_t *p;
+        int i, j;
+
+        if (!(p = get_plane_footprint(planeno, t))) continue;
+
+        /* If our waypoint is inside the exclusion region then get our object out of the way! */
+        if (inside(&last_node->p, p, 4)) return 0;
+
+        for (i=0, j=3; i<4; j=i++)
+            if (intersect(&last_node->p, &next_node->p, p+i, p+j))
+            {
+                route->collision_delay = COLLISION_INTERVAL;	/* Planes don't wake us */
+                return (route_t*) -1;	/* Next edge intersects this plane's footprint */
+            }
+    }
+
+    return NULL;
+}
+
+
+/* Routes are scheduled in a min-heap ordered by the time that they're next due to change state - i.e. when
+ * route_now >= next_time - so that simulate() only needs to run the state machine for routes that are due.
+ * Children that are frozen aren't scheduled. */
+
+static inline int isearlier(route_t *a, route_t *b)
+{
+    return a->next_time + a->object.lag < b->next_time + b->object.lag;
+}
 
-    /* Route collisions */
-    while (c)
+static inline void setevent(int i, route_t *route)
+{
+    airport.events[i] = route;
+    route->event = i;
+}
+
+/* Move a route to its place in the heap after its next_time has changed, or add it if not already there */
+static void schedule(route_t *route)
+{
+    route_t **events = airport.events;
+    int i = route->event;
+
+    if (i < 0)
+        i = airport.eventcount++;
+
+    /* Up towards earlier routes */
+    while (i > 0 && isearlier(route, events[(i-1)/2]))
+    {
+        setevent(i, events[(i-1)/2]);
+        i = (i-1)/2;
+    }
+
+    /* Down past earlier routes */
+    while (2*i+1 < airport.eventcount)
     {
-        path_t *c_end_node;
+        int child = 2*i+1;
+        if (child+1 < airport.eventcount && isearlier(events[child+1], events[child])) child++;
+        if (!isearlier(events[child], route)) break;
+        setevent(i, events[child]);
+        i = child;
+    }
+    setevent(i, route);
+}
+
+/* Remove a route from the heap, if it's there */
+static void unschedule(route_t *route)
+{
+    route_t *last;
 
-	/* Avoid immediate deadlock if we're just enabled/activated */
-        if (c->route->last_node == c->route->next_node)
+    if (route->event < 0) return;
+    last = airport.events[--airport.eventcount];
+    if (last != route)
+    {
+        last->event = route->event;
+        schedule(last);		/* Takes route's place */
+    }
+    route->event = -1;
+}
+
+/* For qsort - order routes by position in routetbl, i.e. draw order */
+static int sortdraworder(const void *a, const void *b)
+{
+    const route_t *ra = *(const route_t **) a, *rb = *(const route_t **) b;
+    return ra < rb ? -1 : (ra > rb ? 1 : 0);
+}
+
+/* Schedule all routes. Called on activation once routes are in their final place. Returns 0 on OOM. */
+int scheduleroutes(airport_t *airport, int count)
+{
+    route_t *route;
+
+    if (!airport->events && !(airport->events = malloc((count ? count : 1) * sizeof(route_t*))))
+        return 0;
+    if (!airport->due && !(airport->due = malloc((count ? count : 1) * sizeof(route_t*))))
+        return 0;
+
+    airport->eventcount = 0;
+    for (route = airport->routes; route; route = route->next)
+    {
+        route->event = -1;
+        if (!route->state.frozen) schedule(route);
+    }
+    return -1;
+}
+
+
+/* Routes whose drawing position can change are listed in airport.moving, in draw order. Routes that are paused or
+ * waiting, and children frozen behind them, are dormant - their drawing position was calculated when they stopped and
+ * doesn't change, so simulate() skips them until their state next changes. */
+
+static inline int isdormant(route_t *route)
+{
+    return route->state.paused || route->state.waiting || route->state.dataref || route->state.collision || route->state.frozen;
+}
+
+/* Return a dormant route, and any children frozen behind it, to the moving set in this frame */
+static void rouse(route_t *route)
+{
+    route_t **child;
+
+    if (!route->state.dormant) return;
+    route->state.dormant = 0;
+    airport.woken[airport.wokencount++] = route;
+    if (route->children >= 0)
+        for (child = airport.children + route->children; *child; child++)
+            rouse(*child);
+}
+
+/* Merge routes roused since the last frame into the moving set, keeping it in draw order */
+static void mergewoken()
+{
+    route_t **moving = airport.moving, **woken = airport.woken;
+    int i = airport.movingcount - 1, j = airport.wokencount - 1, k = airport.movingcount + airport.wokencount - 1;
+
+    if (!airport.wokencount) return;
+    qsort(woken, airport.wokencount, sizeof(route_t*), sortdraworder);
+    while (j >= 0)
+        moving[k--] = (i >= 0 && moving[i] > woken[j]) ? moving[i--] : woken[j--];
+    airport.movingcount += airport.wokencount;
+    airport.wokencount = 0;
+}
+
+/* Put all routes in the moving set, e.g. because route paths have been re-mapped */
+void rouseroutes(airport_t *airport)
+{
+    route_t *route;
+
+    airport->movingcount = airport->wokencount = 0;
+    for (route = airport->routes; route; route = route->next)
+    {
+        route->state.dormant = route->state.reduced = 0;
+        airport->moving[airport->movingcount++] = route;
+    }
+}
+
+/* Set up the moving set, and lists of the children that are roused with each parent. Called on activation once routes
+ * are in their final place. Returns 0 on OOM. */
+int partitionroutes(airport_t *airport, int count)
+{
+    route_t *route, **child;
+    int n = 0;
+
+    if ((!airport->moving && !(airport->moving = malloc((count ? count : 1) * sizeof(route_t*)))) ||
+        (!airport->woken && !(airport->woken = malloc((count ? count : 1) * sizeof(route_t*)))))
+        return 0;
+
+    /* Count children, and allot each parent a NULL-terminated run of airport->children */
+    for (route = airport->routes; route; route = route->next)
+        route->children = 0;
+    for (route = airport->routes; route; route = route->next)
+        if (route->parent && !route->highway)
+            route->parent->children++;
+    for (route = airport->routes; route; route = route->next)
+        if (route->children)
         {
-            c = c->next;
-            continue;
+            int c = route->children;
+            route->children = n;
+            n += c + 1;
         }
+        else
+            route->children = -1;
 
-        c_end_node = c->route->path + (c->node+1 >= c->route->pathlen ? 0 : c->node+1);	/* Node at end of colliding segment */
-        if(route->direction>0 && c->route->direction>0 && next_node->waypoint.lat == c_end_node->waypoint.lat && next_node->waypoint.lon == c_end_node->waypoint.lon)
+    free(airport->children);
+    if (!(airport->children = calloc(n ? n : 1, sizeof(route_t*))))
+        return 0;
+    for (route = airport->routes; route; route = route->next)
+        if (route->parent && !route->highway)
         {
-            /* Co-located end nodes */
+            for (child = airport->children + route->parent->children; *child; child++);
+            *child = route;
+        }
+
+    rouseroutes(airport);
+    return -1;
+}
+
+
+/* Wake a route that's waiting for a collision so that it re-checks now rather than at its timeout */
+static inline void wakeroute(route_t *route, float now)
+{
+    if (!(route->state.paused || route->state.waiting || route->state.dataref) &&	/* Will re-check when these finish */
+        route->next_time > now - route->object.lag)
+    {
+        route->next_time = now - route->object.lag;
+        if (route->event >= 0) schedule(route);	/* Else it's being processed in this frame */
+    }
+}
 
-            /* Have to wait if he's sitting on the co-located end node */
-            if (c->route->last_node == c->node+1 &&
-                (c->route->state.dataref || c->route->state.waiting || c->route->state.collision ||
-                 (c->route->state.paused && route->next_time + t <= c->route->next_time + COLLISION_INTERVAL))) /* Our next_time hasn't yet been updated yet so ~= now. His next_time is the time he will unpause. */
+
+/* (Re-)check for collision. If we have to wait for another route, get on its list of routes to wake when it moves.
+ * Routes waiting for each other form a graph with at most one edge out of each route. We check for a cycle - i.e.
+ * deadlock - whenever we add an edge, and break it by letting the route in the cycle with the lowest line number
+ * ignore other routes. So every cycle contains a route marked as deadlocked until that route re-checks. */
+static void checkcollision(route_t *route, float now)
+{
+    route_t *c = route->state.collision;
+
+    if (c && c != (route_t*) -1)
+    {
+        route_t **waiter;
+        for (waiter = &c->waiters; *waiter; waiter = &(*waiter)->next_waiter)
+            if (*waiter == route)
             {
-                route->deadlocked = COLLISION_TIMEOUT;	/* Wait potentially forever */
-                return c;
+                *waiter = route->next_waiter;	/* Unlink from previous route's list */
+                break;
             }
+    }
+
+    route->state.collision = c = iscollision(route, !route->deadlocked);
+    route->deadlocked = 0;
+
+    if (c && c != (route_t*) -1)
+    {
+        route_t *other = c, *victim = route;
+
+        /* Follow the routes that are waiting for each other. Stop at a deadlock that's already being broken. */
+        while (other != route && !other->deadlocked && other->state.collision && other->state.collision != (route_t*) -1)
+        {
+            if (other->lineno < victim->lineno) victim = other;
+            other = other->state.collision;
+        }
+
+        if (other == route && victim == route)
+        {
+            route->state.collision = iscollision(route, 0);	/* Deadlock - we go */
+            return;
+        }
+        else if (other == route)
+        {
+            victim->deadlocked = -1;	/* Deadlock - victim goes when it re-checks */
+            wakeroute(victim, now);
+        }
+
+        route->next_waiter = c->waiters;
+        c->waiters = route;
+    }
+}
+
+
+static void unreserve(reservation_t *reservation)
+{
+    reservation_t **r;
+
+    if (!reservation->zone) return;
+    for (r = &reservation->zone->reservations; *r; r = &(*r)->next)
+        if (*r == reservation)
+        {
+            *r = reservation->next;
+            break;
+        }
+    reservation->zone = NULL;
+}
+
+
+static void reserve(route_t *route, reservation_t *reservation, int zoneno, float from, float to)
+{
+    reservation_t **r;
+
+    reservation->route = route;
+    reservation->zone = airport.zones + zoneno;
+    reservation->from = from;
+    reservation->to = to;
+    for (r = &reservation->zone->reservations; *r && (*r)->from <= from; r = &(*r)->next);
+    reservation->next = *r;
+    *r = reservation;
+}
+
 
-            /* Have to wait if he will wait when he reaches the co-located end node, or if we'll get there too early */
-            /* We don't check whether he *might* wait for a collision - gets too complicated */
-            if (c->route->last_node == c->node &&	/* On colliding segment */
-                !(c->route->state.dataref || c->route->state.waiting || c->route->state.collision || c->route->state.paused) &&	/* He's not waiting at previous node */
-                (c_end_node->whenrefs || c_end_node->attime[0] != INVALID_AT ||
-                 route->next_time + t <= c->route->next_time + COLLISION_INTERVAL + c_end_node->pausetime)) /* Our route->next_time hasn't yet been updated yet so ~= now */
+/* Replace our reservations after we've decided what to do next. While moving we hold the segment that we're on,
+ * and the node that we're heading for until we'll have left it. While waiting we hold just the node that we're at. */
+static void reserveroute(route_t *route)
+{
+    path_t *last_node = route->path + route->last_node;
+    path_t *next_node = route->path + route->next_node;
+
+    unreserve(&route->segment_reservation);
+    unreserve(&route->node_reservation);
+    if (route->parent || route->highway) return;	/* Only the head of a train is subject to collisions */
+    if (!airport.zones) return;		/* check_collisions() failed or hasn't finished */
+
+    if (!(route->state.paused || route->state.waiting || route->state.dataref || route->state.collision))
+    {
+        path_t *c_node = route->direction>0 ? last_node : next_node;	/* Node at start of our segment (assuming forwards direction) */
+
+        if (c_node->segment_zone >= 0)
+            reserve(route, &route->segment_reservation, c_node->segment_zone, route->last_time, route->next_time);
+        if (route->direction>0 && next_node->node_zone >= 0)
+            reserve(route, &route->node_reservation, next_node->node_zone, route->next_time,
+                    (next_node->whenrefs || next_node->attime) ? FLT_MAX : route->next_time + COLLISION_INTERVAL + next_node->pausetime);
+    }
+    else if (route->direction>0 && last_node->node_zone >= 0)
+    {
+        /* next_time is the time we'll unpause */
+        reserve(route, &route->node_reservation, last_node->node_zone, route->last_time,
+                (route->state.waiting || route->state.dataref || route->state.collision) ? FLT_MAX : route->next_time + COLLISION_INTERVAL);
+    }
+}
+
+
+/* Whether a moving route is on the straight part of its segment, i.e. whether the drawing code in calcposition()
+ * would just interpolate between last_node and next_node */
+static inline int isstraight(route_t *route, path_t *last_node, path_t *next_node, float progress, float route_now)
+{
+    if (route->state.backingup || (route->state.forwardsb && (last_node->p1.x || last_node->p1.z)))
+        return 0;
+    else if (progress >= 0.5f)
+        return next_node->flags.backup || route->next_time - route_now >= TURN_TIME/2 || !(next_node->p1.x || next_node->p1.z);
+    else
+        return !((last_node->p3.x || last_node->p3.z) &&
+                 (route->state.forwardsa ? progress < 0 : route_now - route->last_time < TURN_TIME/2));
+}
+
+
+/* Add a route that's turning through a waypoint to the batch, returning its lane */
+static inline int bezlane(bezbatch_t *batch, route_t *route, point_t *p1, point_t *p2, point_t *p3, float mu, float steersign, float steerbase)
+{
+    int lane = batch->count++;
+
+    // assert (mu>=0 && mu<=1);	// Trains may go negative at start or in replay
+    batch->drawinfo[lane] = route->drawinfo;
+    batch->steer[lane] = &route->steer;
+    batch->p1x[lane] = p1->x;
+    batch->p1z[lane] = p1->z;
+    batch->p2x[lane] = p2->x;
+    batch->p2z[lane] = p2->z;
+    batch->p3x[lane] = p3->x;
+    batch->p3z[lane] = p3->z;
+    batch->mu[lane] = mu;
+    batch->steersign[lane] = steersign;
+    batch->steerbase[lane] = steerbase;
+    batch->hadjust[lane] = route->state.backingup ? -180 : 0;
+    batch->offset[lane] = route->object.offset;
+    batch->objheading[lane] = route->object.heading;
+    return lane;
+}
+
+
+/* Reasons that a route isn't moving */
+static inline int waitflags(route_t *route)
+{
+    return (route->state.paused ? 1 : 0) | (route->state.waiting ? 2 : 0) | (route->state.dataref ? 4 : 0) | (route->state.collision ? 8 : 0);
+}
+
+
+/* Routes waiting for this route should re-check for collisions now rather than at their timeout */
+static void wakewaiters(route_t *route, float now)
+{
+    route_t *waiter;
+
+    while ((waiter = route->waiters))
+    {
+        route->waiters = waiter->next_waiter;
+        wakeroute(waiter, now);
+    }
+}
+
+
+/* Do all of a waypoint's When DataRefs have values in range? */
+static int whenpassed(whenref_t *whenref)
+{
+    while (whenref)
+    {
+        float val;
+        extref_t *extref = whenref->extref;
+
+        if (extref->type == xplmType_Mine)
+        {
+            val = userrefcallback(extref->ref);
+        }
+        else if (whenref->idx < 0)
+        {
+            /* Not an array */
+            if (extref->type & xplmType_Float)
+                val = XPLMGetDataf(extref->ref);
+            else if (extref->type & xplmType_Double)
+                val = XPLMGetDatad(extref->ref);
+            else if (extref->type & xplmType_Int)
+                val = XPLMGetDatai(extref->ref);
+            else
+                val = 0;	/* Lookup failed or otherwise unusable */
+        }
+        else if (extref->type & xplmType_FloatArray)
+        {
+            XPLMGetDatavf(extref->ref, &val, whenref->idx, 1);
+        }
+        else if (extref->type & xplmType_IntArray)
+        {
+            int ival;
+            XPLMGetDatavi(extref->ref, &ival, whenref->idx, 1);
+            val = ival;
+        }
+        else
+        {
+            val = 0;	/* Lookup failed or otherwise unusable */
+        }
+
+        if ((val >= whenref->from) && (val <= whenref->to))
+            whenref = whenref->next;
+        else
+            return 0;		/* fail */
+    }
+    return -1;	/* All passed */
+}
+
+
+/* Move a route on to its next waypoint and enter any states that the waypoint starts. Returns the waypoint's Set
+ * commands, to be actioned once last_time is known. */
+static setcmd_t *arrive(route_t *route, float now)
+{
+    path_t *last_node, *next_node;
+    setcmd_t *setcmd = NULL;
+
+    route->last_node = route->next_node;
+    route->next_node += route->direction;
+    if (!route->last_node || (route->highway && route->next_node >= route->pathlen))
+        route->last_distance = 0;	/* reset distance travelled to prevent growing stupidly large */
+    else if (route->state.backingup)
+        route->last_distance -= route->next_distance;
+    else
+        route->last_distance += route->next_distance;
+    route->distance = route->last_distance;
+
+    if (route->highway && !route->next_time)
+    {
+        /* reset highway route - binary search for the first node at or beyond our offset */
+        int lo = 1, hi = route->pathlen;
+
+        while (lo < hi)
+        {
+            int mid = (lo + hi) / 2;
+            if (route->path[mid].distance >= route->highway_offset)
+                hi = mid;
+            else
+                lo = mid + 1;
+        }
+        route->distance = route->highway_offset;
+        route->last_distance = route->path[lo-1].distance;
+        if (lo < route->pathlen)
+        {
+            route->next_time = now - (route->highway_offset - route->last_distance) / route->speed;
+            route->last_node = lo-1;
+            route->next_node = lo;
+        }
+    }
+    else if (route->path[route->last_node].flags.reverse)
+    {
+        route->direction = -1;
+        route->next_node = route->pathlen-2;
+    }
+    else if (route->next_node >= route->pathlen)
+    {
+        /* At end of route */
+        if (route->highway)
+        {
+            route->last_node = 0;	/* jump back to start */
+            route->next_node = 1;
+            route->next_y = INVALID_ALT;	/* Discontinuity so reset */
+        }
+        else
+        {
+            route->next_node = 0;	/* head on to start */
+        }
+    }
+    else if (route->next_node < 0)
+    {
+        /* Back at start of route - start again */
+        route->direction = 1;
+        route->next_node = 1;
+    }
+    last_node = route->path + route->last_node;
+    next_node = route->path + route->next_node;
+
+    /* Segment geometry was calculated by maproutes() assuming forwards direction */
+    if (route->direction > 0)
+    {
+        route->next_heading = last_node->segment_heading;
+        route->next_distance = last_node->segment_length;
+    }
+    else
+    {
+        route->next_heading = next_node->segment_heading > 0 ? next_node->segment_heading - 180 : next_node->segment_heading + 180;
+        route->next_distance = next_node->segment_length;
+    }
+
+    if (!route->parent)
+    {
+        if (last_node->whenrefs)
+            route->state.dataref = 1;
+        if (last_node->attime)
+            route->state.waiting = 1;
+        if (last_node->pausetime)
+            route->state.paused = 1;
+        setcmd = last_node->setcmds;
+        if (last_node->flags.backup)
+        {
+            if (last_node->pausetime)	/* A */
             {
-                route->deadlocked = COLLISION_TIMEOUT;	/* Wait potentially forever */
-                return c;
+                /* Backing up after pause */
+                route->state.backingup = 1;
+                route->state.forwardsa = 1;
+            }
+            else						/* Y */
+            {
+                /* Backing up before pause */
+                route->state.forwardsb = 1;
             }
         }
         else
         {
-            /* Paths cross */
-
-            if ((c->route->direction>0 ? c->route->last_node : c->route->next_node) == c->node &&	/* On colliding segment */
-                /* No point waiting for a route that is itself waiting for any reason. He'll re-check on exit from wait. */
-                !(c->route->state.dataref||c->route->state.waiting||c->route->state.collision||c->route->state.paused) &&
-                /* At similar altitude? */
-                fabsf(c->route->drawinfo->y - route->drawinfo->y) <= COLLISION_ALT)
+            if (!route->state.forwardsa)			/* !Q */
+            {
+                route->state.backingup = 0;
+                route->state.forwardsb = 0;
+            }
+            if (!route->state.backingup && !route->state.forwardsb)	/* !B */
             {
-                route->deadlocked = tryno;		/* Collision */
-                return c;
+                route->state.forwardsa = 0;
             }
         }
-        c = c->next;
     }
+    return setcmd;
+}
+
 
-    /* Plane collisions */
-    for (planeno=0; planeno<count_planes(); planeno++)
+/* Calculate when a route's state next changes, from last_time when it entered that state */
+static void settimes(route_t *route, path_t *last_node)
+{
+    if (route->state.waiting)
+        route->next_time = route->last_time + AT_INTERVAL;
+    else if (route->state.dataref)
+        route->next_time = route->last_time + WHEN_INTERVAL;
+    else if (route->state.paused)
+        route->next_time = route->last_time + last_node->pausetime;
+    else if (route->state.collision)
+        route->next_time = route->last_time + route->collision_delay;
+    else if (route->state.forwardsa && !last_node->flags.backup)			/* B */
     {
-        point_t *p;
-        int i, j;
+        route->next_distance += route->speed * TURN_TIME;	/* Allow for extra turning distance */
+        route->next_time = route->last_time + route->next_distance / route->speed;
+    }
+    else if (route->state.forwardsb && last_node->flags.backup)	/* Y */
+    {
+        route->last_time += TURN_TIME;	/* Allow for extra turning distance */
+        route->next_time = route->last_time + route->next_distance / route->speed;
+    }
+    else
+        route->next_time = route->last_time + route->next_distance / route->speed;
+}
 
-        if (!(p = get_plane_footprint(planeno, t))) continue;
 
-        /* If our waypoint is inside the exclusion region then get our object out of the way! */
-        if (inside(&last_node->p, p, 4)) return 0;
+/* Set DataRefs. Need to do this after calculating last_time */
+static void setcommands(route_t *route, path_t *last_node, setcmd_t *setcmd)
+{
+    while (setcmd)
+    {
+        userref_t *userref = setcmd->userref;
 
-        for (i=0, j=3; i<4; j=i++)
-            if (intersect(&last_node->p, &next_node->p, p+i, p+j))
-                return (collision_t*) -1;	/* Next edge intersects this plane's footprint */
+        userref->duration = setcmd->duration;
+        userref->slope = setcmd->flags.slope;
+        userref->curve = setcmd->flags.curve;
+        if (setcmd->flags.set2)
+        {
+            userref->start1 = route->last_time;
+            userref->start2 = route->last_time + last_node->pausetime - userref->duration;
+        }
+        else if (setcmd->flags.set1)
+        {
+            userref->start1 = route->last_time;
+            userref->start2 = 0;
+        }
+        setcmd = setcmd->next;
     }
+}
 
-    return NULL;
+
+
+/* Get current day-of-week. FIXME: This is in user's timezone, not the airport's. */
+static unsigned int dayofweek(void)
+{
+    struct tm tm = { 0, 0, 12, XPLMGetDatai(ref_doy)+1, 0, year };
+    return (mktime(&tm) == -1) ? DAY_SUN : 1 << tm.tm_wday;
+}
+
+
+/* Time of the first At poll, counting the one due at route->next_time, that will see one of the waypoint's At times -
+ * or FLT_MAX if none are today. tod is the time of day [s] at route time route_now. AT_INTERVAL is a minute, so each
+ * poll sees the minute after the one before. */
+static float nextattime(route_t *route, attime_t *attime, float route_now, float tod, unsigned int dow)
+{
+    float poll_tod = fmodf(tod - (route_now - route->next_time), 24*60*60);
+    int minute, polls = -1, i;
+
+    if (poll_tod < 0) poll_tod += 24*60*60;
+    minute = (int) (poll_tod / 60);
+    for (i=0; i<MAX_ATTIMES && attime->times[i] != INVALID_AT; i++)
+        if (attime->days & dow)
+        {
+            int n = ((attime->times[i] - minute) % (24*60) + 24*60) % (24*60);
+            if (polls < 0 || n < polls) polls = n;
+        }
+    return polls < 0 ? FLT_MAX : route->next_time + polls * AT_INTERVAL;
+}
+
+
+/* Advance a route that has fallen far behind - because sim time has jumped, or we were deactivated - through the
+ * transitions that it would have made up to route_now, without simulating the time in between.
+ * We don't know where other routes were in the meantime, so collisions are only checked at the last transition.
+ * At waits are resolved against the time of day at which each poll would have happened, but When DataRefs can
+ * only be tested against their current values - so a When waypoint that lets the route through once lets it
+ * through every lap. Once a route comes back to a waypoint in the same state with no At waypoints in between, its
+ * behaviour repeats so we skip over as many whole laps as fit in one go. A lap with an At waypoint departs at a
+ * different time of day each lap, so we step through it - but each At wait is resolved in one go, so the cost is
+ * proportional to the number of waypoints and At departures rather than to how far behind the route is.
+ * Children of a train are lined up behind their parent afterwards. */
+static void fastforward(route_t *route, float route_now, float now)
+{
+    path_t *last_node;
+    setcmd_t *setcmd;
+    int lap_node = -1, lap_direction = 0, lap_backup = 0, backup;
+    float lap_time = 0, lap_distance = 0, tod = -1;
+    unsigned int dow = 0;
+
+    while (route->next_time <= route_now)
+    {
+        float saved_last_time, saved_next_time, saved_next_distance;
+        int arrived = 0;
+
+        setcmd = NULL;
+        if (route->state.waiting)
+        {
+            float depart;
+
+            if (!dow) dow = dayofweek();
+            if (tod < 0) tod = XPLMGetDataf(ref_tod);
+            if ((depart = nextattime(route, route->path[route->last_node].attime, route_now, tod, dow)) > route_now)
+            {
+                /* Still waiting - carry on polling from the last poll before now */
+                route->last_time = route->next_time + floorf((route_now - route->next_time) / AT_INTERVAL) * AT_INTERVAL;
+                route->next_time = route->last_time + AT_INTERVAL;
+                return;
+            }
+            route->state.waiting = 0;
+            route->next_time = depart;
+        }
+        else if (route->state.dataref)
+        {
+            if (!whenpassed(route->path[route->last_node].whenrefs))
+            {
+                /* Still waiting - carry on polling from now */
+                route->last_time = route_now;
+                route->next_time = route_now + WHEN_INTERVAL;
+                return;
+            }
+            route->state.dataref = 0;
+        }
+        else if (route->state.paused)
+        {
+            route->state.paused = 0;
+        }
+        else	/* next waypoint */
+        {
+            setcmd = arrive(route, now);
+            arrived = -1;
+        }
+
+        last_node = route->path + route->last_node;
+        route->last_time = route->next_time;
+
+        if (arrived)
+        {
+            backup = (route->state.forwardsb ? 1 : 0) | (route->state.backingup ? 2 : 0) | (route->state.forwardsa ? 4 : 0);
+            if (last_node->attime)
+            {
+                lap_node = -1;	/* Laps aren't repeatable */
+            }
+            else if (route->last_node == lap_node && route->direction == lap_direction && backup == lap_backup && route->last_distance == lap_distance)
+            {
+                /* Back where we were a lap ago - skip over as many whole laps as we can */
+                float lap = route->last_time - lap_time;
+                if (lap <= 0)
+                {
+                    route->last_time = route->next_time = route_now;	/* Going nowhere */
+                    break;
+                }
+                route->last_time += floorf((route_now - route->last_time) / lap) * lap;
+                lap_node = -1;
+            }
+            else if (lap_node < 0 || route->last_node == lap_node)
+            {
+                /* Start a new lap here */
+                lap_node = route->last_node;
+                lap_direction = route->direction;
+                lap_backup = backup;
+                lap_distance = route->last_distance;
+                lap_time = route->last_time;
+            }
+        }
+
+        saved_last_time = route->last_time;
+        saved_next_time = route->next_time;
+        saved_next_distance = route->next_distance;
+        settimes(route, last_node);
+        if (route->next_time > route_now && !route->parent)
+        {
+            /* Caught up - check for collisions with where other routes are now, as if we'd made this transition normally */
+            route->last_time = saved_last_time;
+            route->next_time = saved_next_time;
+            route->next_distance = saved_next_distance;
+            checkcollision(route, now);
+            settimes(route, last_node);
+            setcommands(route, last_node, setcmd);
+            break;	/* Any collision is re-checked as normal from here */
+        }
+        setcommands(route, last_node, setcmd);
+    }
+
+    if (route->children >= 0 && !route->highway)
+    {
+        route_t **child;
+        for (child = airport.children + route->children; *child; child++)
+        {
+            (*child)->state.lineup = 1;
+            rouse(*child);
+        }
+    }
 }
 
 
@@ -117,6 +923,16 @@ void labelcallback(XPLMWindowID inWindowID, void *inRefcon)
 }
 
 
+/* Could the route be within draw range anywhere on its current segment? Allows for turns, train lag and offset.
+ * Only considers horizontal distance so is conservative. */
+static inline int isdistant(route_t *route, path_t *last_node, path_t *next_node, point_t *view)
+{
+    float radius = route->next_distance * 0.5f + route->speed * (TURN_TIME + route->object.lag) + fabsf(route->object.offset);
+
+    return !indrawrange((last_node->p.x + next_node->p.x) * 0.5f - view->x, 0, (last_node->p.z + next_node->p.z) * 0.5f - view->z, route->object.drawlod * lod_factor + radius);
+}
+
+
 /* Actually do the drawing. Uses global drawroute so DataRef callbacks have access to the route being drawn.
  * Tries to batch concurrent routes that use the same XPLMObjectRef (note: not textual name since one name
  * might map to multiple library objects). Route linked list was sorted in XPLMObjectRef order during activate().
@@ -125,14 +941,11 @@ void labelcallback(XPLMWindowID inWindowID, void *inRefcon)
  * Note we don't know that an object uses per-route DataRefs until we draw it for the first time when the
  * accessor callback will set route->state.hasdataref.
  * If some objects are in range but others not then we issue one XPLMDrawObjects() call that spans all those
- * in range, since this seems to be cheaper than multiple calls even if more drawing results. */
-static void drawroutes()
+ * in range, since this seems to be cheaper than multiple calls even if more drawing results.
+ * Draws the positions interpolated for this frame in airport.framedrawinfo, which parallels airport.drawinfo. */
+static void drawroutes(point_t *view)
 {
-    float view_x, view_y, view_z;
-
-    view_x=XPLMGetDataf(ref_view_x);
-    view_y=XPLMGetDataf(ref_view_y);
-    view_z=XPLMGetDataf(ref_view_z);
+    XPLMDrawInfo_t *drawinfo;
 
     drawroute=airport.routes;
     while (drawroute)
@@ -140,8 +953,9 @@ static void drawroutes()
         if (drawroute->state.hasdataref)	/* Objects that use a per-route DataRef can't be batched */
         {
             /* Have to check draw range every frame since "now" isn't updated while sim paused */
-            if (indrawrange(drawroute->drawinfo->x-view_x, drawroute->drawinfo->y-view_y, drawroute->drawinfo->z-view_z, drawroute->object.drawlod * lod_factor))
-                XPLMDrawObjects(drawroute->object.objref, 1, drawroute->drawinfo, is_night, 1);
+            drawinfo = airport.framedrawinfo + (drawroute->drawinfo - airport.drawinfo);
+            if (indrawrange(drawinfo->x-view->x, drawinfo->y-view->y, drawinfo->z-view->z, drawroute->object.drawlod * lod_factor))
+                XPLMDrawObjects(drawroute->object.objref, 1, drawinfo, is_night, 1);
 
             if (drawroute->next && drawroute->object.objref == drawroute->next->object.objref)
                 drawroute->next->state.hasdataref = -1;	/* propagate flag to all routes using this objref */
@@ -153,15 +967,18 @@ static void drawroutes()
             route_t *route, *first = 0, *last = 0;
 
             for (route=drawroute; route && route->object.objref==drawroute->object.objref; route=route->next)
+            {
                 /* Have to check draw range every frame since "now" isn't updated while sim paused */
-                if (indrawrange(route->drawinfo->x-view_x, route->drawinfo->y-view_y, route->drawinfo->z-view_z, route->object.drawlod * lod_factor))
+                drawinfo = airport.framedrawinfo + (route->drawinfo - airport.drawinfo);
+                if (indrawrange(drawinfo->x-view->x, drawinfo->y-view->y, drawinfo->z-view->z, route->object.drawlod * lod_factor))
                 {
                     if (!first) first = route;
                     last = route;
                 }
+            }
 
             if (first)
-                XPLMDrawObjects(drawroute->object.objref, 1 + last->drawinfo - first->drawinfo, first->drawinfo, is_night, 1);
+                XPLMDrawObjects(drawroute->object.objref, 1 + last->drawinfo - first->drawinfo, airport.framedrawinfo + (first->drawinfo - airport.drawinfo), is_night, 1);
 
             drawroute=route;
         }
@@ -169,122 +986,424 @@ static void drawroutes()
 }
 
 
-/* Main update and draw loop */
-int drawcallback(XPLMDrawingPhase inPhase, int inIsBefore, void *inRefcon)
+/* Calculate drawing position for a route from the state left by simulate() in this step. Only touches the
+ * route's own drawing state, so different threads can calculate different routes. */
+static void calcposition(route_t *route, straightbatch_t *batch, bezbatch_t *bezbatch)
 {
-    double airport_x, airport_y, airport_z;
-    float now;
-    route_t *route;
-    int tod=-1;
-    unsigned int dow=0;
-    XPLMProbeInfo_t probeinfo;
-#ifdef DO_BENCHMARK
-    struct timeval t1, t2;
-    gettimeofday(&t1, NULL);		/* start */
-#endif
+    path_t *last_node = route->path + route->last_node;
+    path_t *next_node = route->path + route->next_node;
+    float route_now = route->draw_time;
+    float progress;
+    int lane = -1;		/* Lane in bezbatch if turning */
 
-    assert (airport.state == active);
+    if (!(route->state.paused||route->state.waiting||route->state.dataref||route->state.collision))
+    {
+        float probe_interval = route->next_probe - route->last_probe;
 
-    XPLMWorldToLocal(airport.tower.lat, airport.tower.lon, airport.tower.alt, &airport_x, &airport_y, &airport_z);
-    if (airport.p.x != airport_x || airport.p.y != airport_y || airport.p.z != airport_z)
+        progress = (route_now - route->last_time) / (route->next_time - route->last_time);
+        if (route->state.backingup)
+            route->distance = route->last_distance - progress * route->next_distance;
+        else
+            route->distance = route->last_distance + progress * route->next_distance;
+        route->steer = 0;
+
+#ifndef DO_MARKERS	/* Markers are drawn below */
+        if (isstraight(route, last_node, next_node, progress, route_now))
+        {
+            /* Plain interpolation along the segment - calculate x, z and pitch in a batch */
+            int lane = batch->count++;
+
+            batch->drawinfo[lane] = route->drawinfo;
+            batch->progress[lane] = progress;
+            batch->x0[lane] = last_node->p.x;
+            batch->z0[lane] = last_node->p.z;
+            batch->dx[lane] = next_node->p.x - last_node->p.x;
+            batch->dz[lane] = next_node->p.z - last_node->p.z;
+            batch->climb[lane] = route->next_y - route->last_y;
+            batch->run[lane] = probe_interval * route->speed;
+            batch->pitchsign[lane] = !route->object.heading ? 1 : (route->object.heading == 180 ? -1 : 0);
+            batch->heading[lane] = route->next_heading;
+            batch->offset[lane] = route->object.offset;
+            route->drawinfo->heading = route->next_heading + route->object.heading;
+            if (batch->count == BATCH_LANES) straightbatch_run(batch);
+            return;
+        }
+#endif
+        if (!route->object.heading)
+            route->drawinfo->pitch = R2D(sinf((route->next_y - route->last_y) / (probe_interval * route->speed)));
+        else if (route->object.heading == 180)
+            route->drawinfo->pitch = R2D(sinf((route->last_y - route->next_y) / (probe_interval * route->speed)));
+    }
+    else
     {
-        /* OpenGL projection has shifted */
-        airport.p.x=airport_x;  airport.p.y=airport_y;  airport.p.z=airport_z;
-        maproutes(&airport);
+        /* Paused: Fake up progress for drawing code below */
+        progress = - (route->object.lag * route->speed) / route->next_distance;
+        route->drawinfo->pitch = 0;	/* Since we're not probing */
     }
 
-    if (!XPLMGetDatai(ref_rentype))
+#ifdef DO_MARKERS
     {
-        int width;
-        XPLMGetScreenSize(&width, NULL);
-        lod_factor = (float) width / lod_bias;	/* Screen size can change while paused, so need to recalculate once per frame */
-#ifdef DO_BENCHMARK
-        drawframes += 1;
+        /* Show markers - which are only visible if shadows turned off! */
+        path_t *node = progress < 0.5f ? last_node : next_node;
+        XPLMSetGraphicsState(0, 0, 0,   0, 0,   0, 0);
+        glLineWidth(3);
+        glColor3f(1,0,0);
+        glBegin(GL_LINE_STRIP);
+        glVertex3f(node->p1.x, node->p.y,    node->p1.z);
+        glVertex3f(node->p1.x, node->p.y+10, node->p1.z);
+        glEnd();
+        glColor3f(0,1,0);
+        glBegin(GL_LINE_STRIP);
+        glVertex3f(node->p.x,  node->p.y,    node->p.z);
+        glVertex3f(node->p.x,  node->p.y+10, node->p.z);
+        glEnd();
+        glColor3f(0,0,1);
+        glBegin(GL_LINE_STRIP);
+        glVertex3f(node->p3.x, node->p.y,    node->p3.z);
+        glVertex3f(node->p3.x, node->p.y+10, node->p3.z);
+        glEnd();
+    }
 #endif
 
-        /* draw route paths */
-        if (airport.drawroutes)
+    /* Finally do the drawing */
+    if (route->state.backingup)
+    {
+        point_t pr;	/* Mirror of p1/p3 */
+
+        if (progress >= 0.5f)
         {
-#ifdef DEBUG
-            int planeno;
-#endif
-            GLint view[4] = { 0 };
+            /* Approaching a waypoint while backing up */
+            if (next_node->flags.backup || route->next_time - route_now >= TURN_TIME/2 || !(next_node->p1.x || next_node->p1.z))
+            {
+                /* No bezier points, or not in range, or approaching backup node */
+                route->drawinfo->x = last_node->p.x + progress * (next_node->p.x - last_node->p.x);
+                route->drawinfo->z = last_node->p.z + progress * (next_node->p.z - last_node->p.z);
+                route->drawinfo->heading = route->next_heading;
+            }
+            else
+            {
+                assert(route->state.forwardsa);
+                pr.x = next_node->p.x + next_node->p.x - next_node->p3.x;
+                pr.z = next_node->p.z + next_node->p.z - next_node->p3.z;
+                if (route->speed * 2 <= route->next_distance)
+                    lane = bezlane(bezbatch, route, &next_node->p1, &next_node->p, &pr, 0.5f + (route_now - route->next_time)/TURN_TIME, -1, route->next_heading);
+                else	/* Short edge */
+                    lane = bezlane(bezbatch, route, &next_node->p1, &next_node->p, &pr, progress - 0.5f, -1, route->next_heading);
+            }
+        }
+        else if (route->state.forwardsb && (route_now - route->last_time < TURN_TIME/2) && (last_node->p1.x || last_node->p1.z))
+        {
+            /* Leaving mirrored p1 waypoint while backing up */
+            pr.x = last_node->p.x + last_node->p.x - last_node->p1.x;
+            pr.z = last_node->p.z + last_node->p.z - last_node->p1.z;
+            if (progress < 0)
+                lane = bezlane(bezbatch, route, &pr, &last_node->p, &last_node->p3, 0.5f + (route_now - route->last_time)/TURN_TIME, -1, 180 + R2D(atan2f(pr.x - last_node->p.x, last_node->p.z - pr.z)));	/* Don't have a route->last_heading */
+            else if (route->speed * 2 <= route->next_distance)
+                lane = bezlane(bezbatch, route, &pr, &last_node->p, &last_node->p3, 0.5f + (route_now - route->last_time)/TURN_TIME, 1, -route->next_heading);
+            else	/* Short edge */
+                lane = bezlane(bezbatch, route, &pr, &last_node->p, &last_node->p3, progress + 0.5f, 1, -route->next_heading);
+        }
+        else if (route->state.forwardsa && (route_now - route->last_time < TURN_TIME/2) && (last_node->p3.x || last_node->p3.z))
+        {
+            /* Leaving a waypoint while backing up */
+            pr.x = last_node->p.x + last_node->p.x - last_node->p3.x;
+            pr.z = last_node->p.z + last_node->p.z - last_node->p3.z;
+            if (route->speed * 2 <= route->next_distance)
+                lane = bezlane(bezbatch, route, &last_node->p1, &last_node->p, &pr, 0.5f + (route_now - route->last_time)/TURN_TIME, 1, 180 - route->next_heading);
+            else	/* Short edge */
+                lane = bezlane(bezbatch, route, &last_node->p1, &last_node->p, &pr, progress + 0.5f, 1, 180 - route->next_heading);
+        }
+        else
+        {
+            route->drawinfo->x = last_node->p.x + progress * (next_node->p.x - last_node->p.x);
+            route->drawinfo->z = last_node->p.z + progress * (next_node->p.z - last_node->p.z);
+            route->drawinfo->heading = route->next_heading;
+        }
+        route->drawinfo->heading -= 180;
+        route->drawinfo->pitch = -route->drawinfo->pitch;
+    } /* (route->state.backingup) */
 
-            XPLMSetGraphicsState(0, 0, 0,   0, 1,   0, 0);
-            glLineWidth(1.5);
+    else if (route->state.forwardsb && (last_node->p1.x || last_node->p1.z))
+    {
+        /* Backing up to pause, keep going to mirror of p1 */
+        progress = 2 - (route->last_time - route_now) / (TURN_TIME/2);
+        route->drawinfo->x = last_node->p.x + progress * (last_node->p.x - last_node->p1.x);
+        route->drawinfo->z = last_node->p.z + progress * (last_node->p.z - last_node->p1.z);
+        route->drawinfo->heading -= route->object.heading;	/* Keep last heading */
+    }
+    else if (progress >= 0.5f)
+    {
+        /* Approaching a waypoint */
+        if (next_node->flags.backup || (route->next_time - route_now >= TURN_TIME/2) || !(next_node->p1.x || next_node->p1.z))
+        {
+            /* No bezier points, or not in range, or approaching backup node */
+            route->drawinfo->x = last_node->p.x + progress * (next_node->p.x - last_node->p.x);
+            route->drawinfo->z = last_node->p.z + progress * (next_node->p.z - last_node->p.z);
+            route->drawinfo->heading = route->next_heading;
+        }
+        else if (route->direction > 0)
+        {
+            if (route->speed * 2 <= route->next_distance)
+                lane = bezlane(bezbatch, route, &next_node->p1, &next_node->p, &next_node->p3, 0.5f + (route_now - route->next_time)/TURN_TIME, 1, -route->next_heading);
+            else	/* Short edge */
+                lane = bezlane(bezbatch, route, &next_node->p1, &next_node->p, &next_node->p3, progress - 0.5f, 1, -route->next_heading);
+        }
+        else
+        {
+            if (route->speed * 2 <= route->next_distance)
+                lane = bezlane(bezbatch, route, &next_node->p3, &next_node->p, &next_node->p1, 0.5f + (route_now - route->next_time)/TURN_TIME, 1, -route->next_heading);
+            else	/* Short edge */
+                lane = bezlane(bezbatch, route, &next_node->p3, &next_node->p, &next_node->p1, progress - 0.5f, 1, -route->next_heading);
+        }
+    }
+    else if (route->state.forwardsa && progress<0 && (last_node->p3.x || last_node->p3.z))
+    {
+        /* Leaving mirror of p3. Special handling to deal with short paths. */
+        progress = (route->last_time - route_now) / (TURN_TIME/2);
+        route->drawinfo->x = last_node->p.x + progress * (last_node->p.x - last_node->p3.x);
+        route->drawinfo->z = last_node->p.z + progress * (last_node->p.z - last_node->p3.z);
+        route->drawinfo->heading = route->next_heading;
+    }
+    else if (!route->state.forwardsa && (route_now - route->last_time < TURN_TIME/2) && (last_node->p3.x || last_node->p3.z))
+    {
+        /* Leaving a waypoint (may be from a negative direction if a paused child) */
+        if (route->direction > 0)
+        {
+            if ((progress < 0) || (route->speed * 2 <= route->next_distance))
+                lane = bezlane(bezbatch, route, &last_node->p1, &last_node->p, &last_node->p3, 0.5f + (route_now - route->last_time)/TURN_TIME, -1, route->next_heading);
+            else	/* Short edge */
+                lane = bezlane(bezbatch, route, &last_node->p1, &last_node->p, &last_node->p3, progress + 0.5f, -1, route->next_heading);
+        }
+        else
+        {
+            if ((progress < 0) || (route->speed * 2 <= route->next_distance))
+                lane = bezlane(bezbatch, route, &last_node->p3, &last_node->p, &last_node->p1, 0.5f + (route_now - route->last_time)/TURN_TIME, -1, route->next_heading);
+            else	/* Short edge */
+                lane = bezlane(bezbatch, route, &last_node->p3, &last_node->p, &last_node->p1, progress + 0.5f, -1, route->next_heading);
+        }
+    }
+    else
+    {
+        route->drawinfo->x = last_node->p.x + progress * (next_node->p.x - last_node->p.x);
+        route->drawinfo->z = last_node->p.z + progress * (next_node->p.z - last_node->p.z);
+        route->drawinfo->heading = route->next_heading;
+    }
+    if (lane >= 0)
+    {
+        /* Turning - heading, offset and steer angle are calculated in a batch */
+        if (bezbatch->count == BATCH_LANES) bezbatch_run(bezbatch);
+        return;
+    }
+    if (route->object.offset)
+    {
+        float h = D2R(route->drawinfo->heading);
+        route->drawinfo->x += sinf(h) * route->object.offset;
+        route->drawinfo->z -= cosf(h) * route->object.offset;
+    }
+    if (route->steer)
+        route->steer = fmodf(route->steer + 540, 360) - 180;	/* to range -180..180 */
+    route->drawinfo->heading += route->object.heading;
+}
 
-            XPLMGetScreenSize(view+2, view+3);	/* Real viewport reported by GL_VIEWPORT will be larger than physical screen if FSAA enabled */
-            drawdebug3d(-1, view);
 
-#ifdef DEBUG
-            /* Draw AI plane positions */
-            glColor4f(0,0,0,0.25f);
-            glBegin(GL_QUADS);
-            for (planeno=0; planeno<count_planes(); planeno++)
-            {
-                point_t *p;
-                int i;
+/* Calculate drawing positions for those of count routes that are within draw range and not being extrapolated */
+static void calcpositions(route_t **routes, int count)
+{
+    straightbatch_t batch;
+    bezbatch_t bezbatch;
+    int i;
+
+    batch.count = bezbatch.count = 0;
+    for (i = 0; i < count; i++)
+        if (!(routes[i]->state.distant || routes[i]->state.extrapolating))
+            calcposition(routes[i], &batch, &bezbatch);
+    if (batch.count) straightbatch_run(&batch);
+    if (bezbatch.count) bezbatch_run(&bezbatch);
+}
 
-                if ((p = get_plane_footprint(planeno, 5.f)))	/* Display 5 seconds ahead */
-                    for (i=0; i<4; i++)
-                        glVertex3fv(&(p[i].x));
-            }
-            glEnd();
+
+/* Worker thread that calculates drawing positions for its share of the routes when told to */
+static void *drawthread(void *arg)
+{
+    drawer_t *drawer = arg;
+
+    while (1)
+    {
+        event_wait(&drawer->go);
+        worker_check_stop(&drawer->worker);
+        calcpositions(drawer->routes, drawer->count);
+        event_set(&drawer->done);
+    }
+}
+
+
+/* Start drawers to share calculation of drawing positions with the main thread, if there are enough routes to make it
+ * worthwhile. How the work is shared depends on how many routes are moving, so is decided in each frame. */
+void startdrawers(airport_t *airport, int count)
+{
+    int shares = cpu_count();
+
+    assert (!ndrawers);
+#ifdef DO_MARKERS
+    shares = 1;		/* Markers are drawn during calculation, which must then happen on the main thread */
 #endif
+    if (shares > MAX_DRAWERS + 1) shares = MAX_DRAWERS + 1;
+    if (shares > count / DRAWER_ROUTES) shares = count / DRAWER_ROUTES;
+
+    while (ndrawers < shares - 1)
+    {
+        drawer_t *drawer = drawers + ndrawers;
+
+        if (!event_init(&drawer->go))
+            break;
+        else if (!event_init(&drawer->done))
+        {
+            event_destroy(&drawer->go);
+            break;
         }
+        else if (!worker_start(&drawer->worker, drawthread))
+        {
+            event_destroy(&drawer->go);
+            event_destroy(&drawer->done);
+            break;
+        }
+        ndrawers++;
+    }
+}
+
+
+/* Stop drawers. Must not be called while they're working */
+void stopdrawers()
+{
+    int n;
+
+    for (n = 0; n < ndrawers; n++)
+    {
+        drawers[n].worker.die_please = -1;
+        MemoryBarrier();
+        event_set(&drawers[n].go);
+        worker_wait(&drawers[n].worker);
+        event_destroy(&drawers[n].go);
+        event_destroy(&drawers[n].done);
+    }
+    ndrawers = 0;
+}
+
+/* Draw range is proportional to screen width */
+static void getlodfactor(void)
+{
+    int width;
+    XPLMGetScreenSize(&width, NULL);
+    lod_factor = (float) width / lod_bias;
+}
+
+
+/* Has the OpenGL projection shifted since we last mapped the routes? Returns the tower's new location if so. */
+static int isshifted(dpoint_t *p)
+{
+    double airport_x, airport_y, airport_z;
+
+    XPLMWorldToLocal(airport.tower.lat, airport.tower.lon, airport.tower.alt, &airport_x, &airport_y, &airport_z);
+    p->x=airport_x;  p->y=airport_y;  p->z=airport_z;
+    return airport.p.x != airport_x || airport.p.y != airport_y || airport.p.z != airport_z;
+}
+
+
+/* Advance routes' states and calculate their drawing positions at time now. Called at SIM_RATE from simcallback(),
+ * and from drawcallback() if it needs drawing positions sooner than that. */
+static void simulate(float now)
+{
+    dpoint_t p;
+    point_t view;
+    float step_time, interval;
+    route_t *route;
+    int shifted, tod=-1;
+    unsigned int dow=0;
+    XPLMProbeInfo_t probeinfo;
+    straightbatch_t batch;
+    bezbatch_t bezbatch;
+    int n, ndue, nmoving, shares;
+#ifdef DO_BENCHMARK
+    struct timeval t1, t2;
+    gettimeofday(&t1, NULL);		/* start */
+#endif
+
+    assert (airport.state == active);
+
+    if ((shifted = isshifted(&p)))
+    {
+        /* OpenGL projection has shifted */
+        airport.p = p;
+        maproutes(&airport);
     }
 
-    /* We can be called multiple times per frame depending on shadow settings -
-     * ("sim/graphics/view/world_render_type" = 0 if normal draw, 3 if shadow draw (which precedes normal))
-     * So skip calculations and just draw if we've already run the calculations for this frame. */
-    if ((now = XPLMGetDataf(ref_monotonic)) == last_frame)
+    view.x = XPLMGetDataf(ref_view_x);
+    view.y = XPLMGetDataf(ref_view_y);
+    view.z = XPLMGetDataf(ref_view_z);
+    getlodfactor();	/* We may not have drawn since the screen size changed */
+
+    if ((step_time = now - last_frame))
     {
-        drawroutes();
-#ifdef DO_BENCHMARK
-        gettimeofday(&t2, NULL);		/* stop */
-        drawcumul += (t2.tv_sec-t1.tv_sec) * 1000000 + t2.tv_usec - t1.tv_usec;
-#endif
-#ifdef DEBUG
-        if (!XPLMGetDatai(ref_rentype)) last_frame = 0;	/* In DEBUG recalculate positions once per frame for easier debugging */
-#endif
-        return 1;
+        /* Keep the drawing positions from the last step to interpolate from. Else we're re-simulating a paused
+         * step to pick up routes that have come into range, so keep interpolating from the step before. */
+        memcpy(airport.lastdrawinfo, airport.drawinfo, airport.routecount * sizeof(XPLMDrawInfo_t));
+        prev_frame = last_frame;
+        last_frame = now;
     }
-    last_frame = now;
+    stepcount++;
+    last_view = view;
+    last_lod_factor = lod_factor;
+    ndistant = 0;
+    expire_plane_footprints();	/* Planes have moved */
 
-    /* Update and draw */
+    /* Update */
     is_night = (int) (XPLMGetDataf(ref_night) + 0.67f);
     probeinfo.structSize = sizeof(XPLMProbeInfo_t);
+    batch.count = bezbatch.count = 0;
 
-    for(route=airport.routes; route; route=route->next)
+    /* Change state of routes that have arrived at a waypoint, or finished or timed out waiting */
+    for (ndue = 0; airport.eventcount && now - airport.events[0]->object.lag >= airport.events[0]->next_time; ndue++)
     {
-        path_t *last_node, *next_node;
-        float progress;
-        float route_now = now - route->object.lag;	/* Train objects are drawn in the past */
-
-        if (route_now >= route->next_time && !route->state.frozen)
+        airport.due[ndue] = airport.events[0];
+        unschedule(airport.events[0]);
+    }
+    if (ndue > 1)
+        qsort(airport.due, ndue, sizeof(route_t*), sortdraworder);	/* In draw order, as if we'd visited every route */
+    for (n = 0; n < ndue; n++)
+    {
+        path_t *last_node;
+        float route_now;
+        setcmd_t *setcmd = NULL;
+        int old_node, old_waitflags;
+
+        route = airport.due[n];
+        route_now = now - route->object.lag;	/* Train objects are drawn in the past */
+        old_node = route->last_node;
+        old_waitflags = waitflags(route);
+
+        if (route->last_time && route->next_time && route_now - route->next_time >= RESET_TIME &&
+            !route->state.collision && (route->highway || !route->parent))
+        {
+            /* Sim time has jumped or we've been deactivated - catch up in one go */
+            fastforward(route, route_now, now);
+        }
+        else
         {
-            setcmd_t *setcmd = NULL;
-
             if (route->state.waiting)
             {
                 /* We don't get notified when time-of-day changes in the sim, so poll once a minute */
+                attime_t *attime = route->path[route->last_node].attime;
                 int i;
-                if (!dow)
-                {
-                    /* Get current day-of-week. FIXME: This is in user's timezone, not the airport's. */
-                    struct tm tm = { 0, 0, 12, XPLMGetDatai(ref_doy)+1, 0, year };
-                    dow = (mktime(&tm) == -1) ? DAY_SUN : 1 << tm.tm_wday;
-                }
+                if (!dow) dow = dayofweek();
                 if (tod < 0) tod = (int) (XPLMGetDataf(ref_tod)/60);
                 for (i=0; i<MAX_ATTIMES; i++)
                 {
-                    if (route->path[route->last_node].attime[i] == INVALID_AT)
+                    if (attime->times[i] == INVALID_AT)
                         break;
-                    else if ((route->path[route->last_node].attime[i] == tod) &&
-                             (route->path[route->last_node].atdays & dow))
+                    else if ((attime->times[i] == tod) && (attime->days & dow))
                     {
                         route->state.waiting = 0;
-                        route->state.collision = iscollision(route, COLLISION_TIMEOUT);	/* Re-check for collision */
+                        checkcollision(route, now);	/* Re-check for collision */
                         break;
                     }
                 }
@@ -292,67 +1411,22 @@ int drawcallback(XPLMDrawingPhase inPhase, int inIsBefore, void *inRefcon)
             }
             else if (route->state.dataref)
             {
-                whenref_t *whenref = route->path[route->last_node].whenrefs;
-
-                while (whenref)
-                {
-                    float val;
-                    extref_t *extref = whenref->extref;
-
-                    if (extref->type == xplmType_Mine)
-                    {
-                        val = userrefcallback(extref->ref);
-                    }
-                    else if (whenref->idx < 0)
-                    {
-                        /* Not an array */
-                        if (extref->type & xplmType_Float)
-                            val = XPLMGetDataf(extref->ref);
-                        else if (extref->type & xplmType_Double)
-                            val = XPLMGetDatad(extref->ref);
-                        else if (extref->type & xplmType_Int)
-                            val = XPLMGetDatai(extref->ref);
-                        else
-                            val = 0;	/* Lookup failed or otherwise unusable */
-                    }
-                    else if (extref->type & xplmType_FloatArray)
-                    {
-                        XPLMGetDatavf(extref->ref, &val, whenref->idx, 1);
-                    }
-                    else if (extref->type & xplmType_IntArray)
-                    {
-                        int ival;
-                        XPLMGetDatavi(extref->ref, &ival, whenref->idx, 1);
-                        val = ival;
-                    }
-                    else
-                    {
-                        val = 0;	/* Lookup failed or otherwise unusable */
-                    }
-
-                    if ((val >= whenref->from) && (val <= whenref->to))
-                        whenref = whenref->next;
-                    else
-                        break;		/* fail */
-                }
-
-                if (!whenref)
+                if (whenpassed(route->path[route->last_node].whenrefs))
                 {
-                    /* All passed */
                     route->state.dataref = 0;
-                    route->state.collision = iscollision(route, COLLISION_TIMEOUT);	/* Re-check for collision */
+                    checkcollision(route, now);	/* Re-check for collision */
                     /* last and next were calculated when we originally hit this waypoint */
                 }
             }
             else if (route->state.paused)
             {
                 route->state.paused = 0;
-                route->state.collision = iscollision(route, COLLISION_TIMEOUT);	/* Re-check for collision */
+                checkcollision(route, now);	/* Re-check for collision */
                 /* last and next were calculated when we originally hit this waypoint */
             }
             else if (route->state.collision)
             {
-                route->state.collision = iscollision(route, route->deadlocked-1);	/* Break deadlock on timeout */
+                checkcollision(route, now);	/* Re-check for collision */
                 /* last and next were calculated when we originally hit this waypoint */
             }
             else	/* next waypoint */
@@ -361,120 +1435,17 @@ int drawcallback(XPLMDrawingPhase inPhase, int inIsBefore, void *inRefcon)
                 if (route == airport.firstroute)
                 {
                     drawcumul = 0;
-                    drawframes= XPLMGetDatai(ref_rentype) ? 0 : 1;
+                    drawframes = 0;
                 }
 #endif
-                route->last_node = route->next_node;
-                route->next_node += route->direction;
-                if (!route->last_node || (route->highway && route->next_node >= route->pathlen))
-                    route->last_distance = 0;	/* reset distance travelled to prevent growing stupidly large */
-                else if (route->state.backingup)
-                    route->last_distance -= route->next_distance;
-                else
-                    route->last_distance += route->next_distance;
-                route->distance = route->last_distance;
-
-                if (route->highway && !route->next_time)
-                {
-                    /* reset highway route */
-                    int i;
-                    float path_cumul = 0;
-
-                    route->distance = route->highway_offset;
-                    route->last_distance = 0;
-                    for (i=1; i<route->pathlen; i++)
-                    {
-                        path_t *node = route->path+i, *prev = route->path+i-1;
-                        path_cumul += hypotf(node->p.x - prev->p.x, node->p.z - prev->p.z);
-                        if (path_cumul >= route->highway_offset)
-                        {
-                            route->next_time = now - (route->highway_offset - route->last_distance) / route->speed;
-                            route->last_node = i-1;
-                            route->next_node = i;
-                            break;
-                        }
-                        else
-                        {
-                            route->last_distance = path_cumul;
-                        }
-                    }
-                }
-                else if (route->path[route->last_node].flags.reverse)
-                {
-                    route->direction = -1;
-                    route->next_node = route->pathlen-2;
-                }
-                else if (route->next_node >= route->pathlen)
-                {
-                    /* At end of route */
-                    if (route->highway)
-                    {
-                        route->last_node = 0;	/* jump back to start */
-                        route->next_node = 1;
-                        route->next_y = INVALID_ALT;	/* Discontinuity so reset */
-                    }
-                    else
-                    {
-                        route->next_node = 0;	/* head on to start */
-                    }
-                }
-                else if (route->next_node < 0)
-                {
-                    /* Back at start of route - start again */
-                    route->direction = 1;
-                    route->next_node = 1;
-                }
-                last_node = route->path + route->last_node;
-                next_node = route->path + route->next_node;
-
-                /* Assume distances are too small to care about earth curvature so just calculate using OpenGL coords */
-                route->next_heading = R2D(atan2f(next_node->p.x - last_node->p.x, last_node->p.z - next_node->p.z));
-                route->next_distance = sqrtf((next_node->p.x - last_node->p.x) * (next_node->p.x - last_node->p.x) +
-                                             (next_node->p.z - last_node->p.z) * (next_node->p.z - last_node->p.z));
-
+                setcmd = arrive(route, now);
                 if (!route->parent)
-                {
-                    if (last_node->whenrefs)
-                        route->state.dataref = 1;
-                    if (last_node->attime[0] != INVALID_AT)
-                        route->state.waiting = 1;
-                    if (last_node->pausetime)
-                        route->state.paused = 1;
-                    setcmd = last_node->setcmds;
-                    if (last_node->flags.backup)
-                    {
-                        if (last_node->pausetime)	/* A */
-                        {
-                            /* Backing up after pause */
-                            route->state.backingup = 1;
-                            route->state.forwardsa = 1;
-                        }
-                        else						/* Y */
-                        {
-                            /* Backing up before pause */
-                            route->state.forwardsb = 1;
-                        }
-                    }
-                    else
-                    {
-                        if (!route->state.forwardsa)			/* !Q */
-                        {
-                            route->state.backingup = 0;
-                            route->state.forwardsb = 0;
-                        }
-                        if (!route->state.backingup && !route->state.forwardsb)	/* !B */
-                        {
-                            route->state.forwardsa = 0;
-                        }
-                    }
-                    route->state.collision = iscollision(route, COLLISION_TIMEOUT);
-                }
+                    checkcollision(route, now);
             }
-            
+
             last_node = route->path + route->last_node;
-            next_node = route->path + route->next_node;
 
-            /* Maintain speed/progress unless there's been a large gap in draw callbacks because we were deactivated / disabled */
+            /* Maintain speed/progress unless we've never run, or we've fallen too far behind and couldn't fast-forward */
             if (route->highway || (route->last_time && route_now - route->next_time < RESET_TIME))
                 route->last_time = route->next_time;
             else
@@ -483,59 +1454,44 @@ int drawcallback(XPLMDrawingPhase inPhase, int inIsBefore, void *inRefcon)
                 route_now = route->last_time - route->object.lag;
             }
 
-            if (route->state.waiting)
-                route->next_time = route->last_time + AT_INTERVAL;
-            else if (route->state.dataref)
-                route->next_time = route->last_time + WHEN_INTERVAL;
-            else if (route->state.paused)
-                route->next_time = route->last_time + last_node->pausetime;
-            else if (route->state.collision)
-                route->next_time = route->last_time + COLLISION_INTERVAL;
-            else if (route->state.forwardsa && !last_node->flags.backup)			/* B */
-            {
-                route->next_distance += route->speed * TURN_TIME;	/* Allow for extra turning distance */
-                route->next_time = route->last_time + route->next_distance / route->speed;
-            }
-            else if (route->state.forwardsb && last_node->flags.backup)	/* Y */
-            {
-                route->last_time += TURN_TIME;	/* Allow for extra turning distance */
-                route->next_time = route->last_time + route->next_distance / route->speed;
-            }
-            else
-                route->next_time = route->last_time + route->next_distance / route->speed;
+            settimes(route, last_node);
+            setcommands(route, last_node, setcmd);
+        }
 
-            /* Set DataRefs. Need to do this after calculating last_time so use hacky flag */
-            while (setcmd)
-            {
-                userref_t *userref = setcmd->userref;
+        /* Force re-probe since we've changed direction */
+        route->next_probe = route_now;
 
-                userref->duration = setcmd->duration;
-                userref->slope = setcmd->flags.slope;
-                userref->curve = setcmd->flags.curve;
-                if (setcmd->flags.set2)
-                {
-                    userref->start1 = route->last_time;
-                    userref->start2 = route->last_time + last_node->pausetime - userref->duration;
-                }
-                else if (setcmd->flags.set1)
-                {
-                    userref->start1 = route->last_time;
-                    userref->start2 = 0;
-                }
-                setcmd = setcmd->next;
-            }
+        reserveroute(route);
 
-            /* Force re-probe since we've changed direction */
-            route->next_probe = route_now;
+        /* Routes waiting for us need to re-check if we've moved on or have stopped waiting for something */
+        if (route->waiters && (route->last_node != old_node || (old_waitflags & ~waitflags(route))))
+            wakewaiters(route, now);
 
-        } // (route_now >= route->next_time && !route->state.frozen)
+        schedule(route);
+        route->state.reduced = 0;	/* May have changed direction, so recalculate drawing position rather than extrapolate */
+        rouse(route);	/* Drawing position may have changed */
+    }
+    mergewoken();
+
+    /* Share calculation of drawing positions with the drawers if lots of routes are moving */
+    shares = airport.movingcount / DRAWER_ROUTES;
+    if (shares > ndrawers + 1) shares = ndrawers + 1;
+
+    for (n = 0; n < airport.movingcount; n++)
+    {
+        path_t *last_node, *next_node;
+        float progress;
+        float route_now;
+
+        route = airport.moving[n];
+        route_now = now - route->object.lag;	/* Train objects are drawn in the past */
 
         /* Parent controls state of children */
         if (route->parent && !route->highway)
         {
-            if ((route->parent->last_time == now) || (route->path[route->pathlen-1].flags.reverse && (!route->parent->last_node || route->parent->last_node==route->pathlen-1)))
+            if ((route->parent->last_time == now) || route->state.lineup || (route->path[route->pathlen-1].flags.reverse && (!route->parent->last_node || route->parent->last_node==route->pathlen-1)))
             {
-                /* Parent was reset or at end of a reversible route - line up back in time from it */
+                /* Parent was reset or fast-forwarded, or at end of a reversible route - line up back in time from it */
                 route->direction = route->parent->direction;
                 route->last_node = route->parent->last_node;
                 route->next_node = route->parent->next_node;
@@ -545,7 +1501,8 @@ int drawcallback(XPLMDrawingPhase inPhase, int inIsBefore, void *inRefcon)
                 route->next_heading = route->parent->next_heading;
                 route->last_time = route->parent->last_time;
                 route->next_time = route->last_time + route->next_distance / route->speed;
-                route->state.frozen = 0;
+                route->state.frozen = route->state.reduced = route->state.lineup = 0;
+                schedule(route);
             }
 
             if (route->parent->state.paused||route->parent->state.waiting||route->parent->state.dataref||route->parent->state.collision)
@@ -555,6 +1512,7 @@ int drawcallback(XPLMDrawingPhase inPhase, int inIsBefore, void *inRefcon)
                 {
                     route->freeze_time = route->parent->last_time;	/* Save time parent started pause */
                     route->state.frozen = 1;
+                    unschedule(route);	/* Until parent unpauses */
                 }
                 route_now = route->freeze_time - route->object.lag;
             }
@@ -563,11 +1521,12 @@ int drawcallback(XPLMDrawingPhase inPhase, int inIsBefore, void *inRefcon)
                 /* Parent has just unpaused - maintain spacing */
                 route->last_time += (route->parent->last_time - route->freeze_time);
                 route->next_time += (route->parent->last_time - route->freeze_time);
-                route->state.frozen = 0;
+                route->state.frozen = route->state.reduced = 0;
+                schedule(route);
             }
         }
 
-        /* Calculate drawing position */
+        /* Calculate altitude. This needs the SDK so is done here rather than in calcpositions() */
         last_node = route->path + route->last_node;
         next_node = route->path + route->next_node;
 
@@ -600,6 +1559,45 @@ int drawcallback(XPLMDrawingPhase inPhase, int inIsBefore, void *inRefcon)
                 route_now = route->last_time - route->object.lag;	/* Train objects are drawn in the past */
             }
 
+            if (!route->state.frozen && !airport.drawroutes)
+            {
+                float range = route->object.drawlod * lod_factor;
+                float xdist = route->drawinfo->x - view.x, ydist = route->drawinfo->y - view.y, zdist = route->drawinfo->z - view.z;
+                float dist2 = xdist*xdist + ydist*ydist + zdist*zdist;
+                unsigned int stagger = stepcount + (unsigned int) (route->drawinfo - airport.drawinfo);
+
+                if (route->state.reduced && dist2 > (NEAR_RANGE*NEAR_RANGE) * range*range &&
+                    (dist2 > (FAR_RANGE*FAR_RANGE) * range*range ? stagger % FAR_STEPS : stagger % MID_STEPS))
+                {
+                    /* Too small to notice the difference, so just extrapolate along our heading at the last calculation */
+                    if (!route->state.extrapolating)
+                    {
+                        float h = D2R(route->drawinfo->heading - route->object.heading) + (route->state.backingup ? (float) M_PI : 0);
+                        route->vx =  sinf(h) * route->speed;
+                        route->vz = -cosf(h) * route->speed;
+                        route->state.extrapolating = 1;
+                    }
+                    route->drawinfo->x += route->vx * step_time;
+                    route->drawinfo->z += route->vz * step_time;
+                    route->distance += (route->state.backingup ? -route->speed : route->speed) * step_time;
+                    continue;
+                }
+                else if (isdistant(route, last_node, next_node, &view))
+                {
+                    /* Can't be seen at this step, so skip probing and calculating drawing position. Park it where it won't
+                     * be drawn, but keep its last known altitude for collision checks. */
+                    route->drawinfo->x = (last_node->p.x + next_node->p.x) * 0.5f;
+                    route->drawinfo->y = route->next_y;
+                    route->drawinfo->z = (last_node->p.z + next_node->p.z) * 0.5f;
+                    route->next_probe = route_now;	/* Probe afresh when we come back into range */
+                    route->state.distant = 1;
+                    route->state.reduced = 0;
+                    ndistant++;
+                    continue;
+                }
+                route->state.reduced = dist2 > (NEAR_RANGE*NEAR_RANGE) * range*range;
+            }
+
             if (route_now >= route->next_probe)
             {
                 /* Probe up to PROBE_INTERVAL into the future */
@@ -624,217 +1622,226 @@ int drawcallback(XPLMDrawingPhase inPhase, int inIsBefore, void *inRefcon)
             {
                 probe_interval = route->next_probe - route->last_probe;
             }
-
-            progress = (route_now - route->last_time) / (route->next_time - route->last_time);
             route->drawinfo->y = route->next_y + (route->last_y - route->next_y) * (route->next_probe - route_now) / probe_interval;
-            if (!route->object.heading)
-                route->drawinfo->pitch = R2D(sinf((route->next_y - route->last_y) / (probe_interval * route->speed)));
-            else if (route->object.heading == 180)
-                route->drawinfo->pitch = R2D(sinf((route->last_y - route->next_y) / (probe_interval * route->speed)));
-            if (route->state.backingup)
-                route->distance = route->last_distance - progress * route->next_distance;
-            else
-                route->distance = route->last_distance + progress * route->next_distance;
-            route->steer = 0;
         }
         else
         {
-            /* Paused: Fake up times for drawing code below */
-            progress = - (route->object.lag * route->speed) / route->next_distance;
+            /* Paused */
             route_now = route->last_time - route->object.lag;
             route->drawinfo->y = route->next_y;
-            route->drawinfo->pitch = 0;	/* Since we're not probing */
         }
-
-#ifdef DO_MARKERS
+        route->draw_time = route_now;
+        route->state.extrapolating = 0;
+        if (route->state.distant)
         {
-            /* Show markers - which are only visible if shadows turned off! */
-            path_t *node = progress < 0.5f ? last_node : next_node;
-            XPLMSetGraphicsState(0, 0, 0,   0, 0,   0, 0);
-            glLineWidth(3);
-            glColor3f(1,0,0);
-            glBegin(GL_LINE_STRIP);
-            glVertex3f(node->p1.x, node->p.y,    node->p1.z);
-            glVertex3f(node->p1.x, node->p.y+10, node->p1.z);
-            glEnd();
-            glColor3f(0,1,0);
-            glBegin(GL_LINE_STRIP);
-            glVertex3f(node->p.x,  node->p.y,    node->p.z);
-            glVertex3f(node->p.x,  node->p.y+10, node->p.z);
-            glEnd();
-            glColor3f(0,0,1);
-            glBegin(GL_LINE_STRIP);
-            glVertex3f(node->p3.x, node->p.y,    node->p3.z);
-            glVertex3f(node->p3.x, node->p.y+10, node->p3.z);
-            glEnd();
+            /* Coming back into range. The only drawing state that calcposition() carries over between steps is
+             * the heading kept while going beyond a backing-up waypoint, which is the heading into that waypoint. */
+            route->drawinfo->heading = R2D(atan2f(last_node->p.x - last_node->p1.x, last_node->p1.z - last_node->p.z)) + route->object.heading;
+            route->state.distant = 0;
+            route->state.emerging = 1;
         }
-#endif
 
-        /* Finally do the drawing */
-        if (route->state.backingup)
-        {
-            point_t pr;	/* Mirror of p1/p3 */
+        if (shares < 2)
+            calcposition(route, &batch, &bezbatch);	/* Just us, so calculate now while route is in cache */
+    }
 
-            if (progress >= 0.5f)
-            {
-                /* Approaching a waypoint while backing up */
-                if (next_node->flags.backup || route->next_time - route_now >= TURN_TIME/2 || !(next_node->p1.x || next_node->p1.z))
-                {
-                    /* No bezier points, or not in range, or approaching backup node */
-                    route->drawinfo->x = last_node->p.x + progress * (next_node->p.x - last_node->p.x);
-                    route->drawinfo->z = last_node->p.z + progress * (next_node->p.z - last_node->p.z);
-                    route->drawinfo->heading = route->next_heading;
-                }
-                else
-                {
-                    assert(route->state.forwardsa);
-                    pr.x = next_node->p.x + next_node->p.x - next_node->p3.x;
-                    pr.z = next_node->p.z + next_node->p.z - next_node->p3.z;
-                    if (route->speed * 2 <= route->next_distance)
-                        bez(route->drawinfo, &next_node->p1, &next_node->p, &pr, 0.5f + (route_now - route->next_time)/TURN_TIME);
-                    else	/* Short edge */
-                        bez(route->drawinfo, &next_node->p1, &next_node->p, &pr, progress - 0.5f);
-                    route->steer = route->next_heading - route->drawinfo->heading;
-                }
-            }
-            else if (route->state.forwardsb && (route_now - route->last_time < TURN_TIME/2) && (last_node->p1.x || last_node->p1.z))
-            {
-                /* Leaving mirrored p1 waypoint while backing up */
-                pr.x = last_node->p.x + last_node->p.x - last_node->p1.x;
-                pr.z = last_node->p.z + last_node->p.z - last_node->p1.z;
-                if (progress <0 || route->speed * 2 <= route->next_distance)
-                    bez(route->drawinfo, &pr, &last_node->p, &last_node->p3, 0.5f + (route_now - route->last_time)/TURN_TIME);
-                else	/* Short edge */
-                    bez(route->drawinfo, &pr, &last_node->p, &last_node->p3, progress + 0.5f);
-                if (progress < 0)
-                    route->steer = 180 - route->drawinfo->heading + R2D(atan2f(pr.x - last_node->p.x, last_node->p.z - pr.z));	/* Don't have a route->last_heading */
-                else
-                    route->steer = route->drawinfo->heading - route->next_heading;
-            }
-            else if (route->state.forwardsa && (route_now - route->last_time < TURN_TIME/2) && (last_node->p3.x || last_node->p3.z))
-            {
-                /* Leaving a waypoint while backing up */
-                pr.x = last_node->p.x + last_node->p.x - last_node->p3.x;
-                pr.z = last_node->p.z + last_node->p.z - last_node->p3.z;
-                if (route->speed * 2 <= route->next_distance)
-                    bez(route->drawinfo, &last_node->p1, &last_node->p, &pr, 0.5f + (route_now - route->last_time)/TURN_TIME);
-                else	/* Short edge */
-                    bez(route->drawinfo, &last_node->p1, &last_node->p, &pr, progress + 0.5f);
-                route->steer = 180 - route->next_heading + route->drawinfo->heading;
-            }
-            else
-            {
-                route->drawinfo->x = last_node->p.x + progress * (next_node->p.x - last_node->p.x);
-                route->drawinfo->z = last_node->p.z + progress * (next_node->p.z - last_node->p.z);
-                route->drawinfo->heading = route->next_heading;
-            }
-            route->drawinfo->heading -= 180;
-            route->drawinfo->pitch = -route->drawinfo->pitch;
-        } /* (route->state.backingup) */
+    if (shares >= 2)
+    {
+        int size = (airport.movingcount + shares - 1) / shares;
 
-        else if (route->state.forwardsb && (last_node->p1.x || last_node->p1.z))
-        {
-            /* Backing up to pause, keep going to mirror of p1 */
-            progress = 2 - (route->last_time - route_now) / (TURN_TIME/2);
-            route->drawinfo->x = last_node->p.x + progress * (last_node->p.x - last_node->p1.x);
-            route->drawinfo->z = last_node->p.z + progress * (last_node->p.z - last_node->p1.z);
-            route->drawinfo->heading -= route->object.heading;	/* Keep last heading */
-        }
-        else if (progress >= 0.5f)
-        {
-            /* Approaching a waypoint */
-            if (next_node->flags.backup || (route->next_time - route_now >= TURN_TIME/2) || !(next_node->p1.x || next_node->p1.z))
-            {
-                /* No bezier points, or not in range, or approaching backup node */
-                route->drawinfo->x = last_node->p.x + progress * (next_node->p.x - last_node->p.x);
-                route->drawinfo->z = last_node->p.z + progress * (next_node->p.z - last_node->p.z);
-                route->drawinfo->heading = route->next_heading;
-            }
-            else if (route->direction > 0)
-            {
-                if (route->speed * 2 <= route->next_distance)
-                    bez(route->drawinfo, &next_node->p1, &next_node->p, &next_node->p3, 0.5f + (route_now - route->next_time)/TURN_TIME);
-                else	/* Short edge */
-                    bez(route->drawinfo, &next_node->p1, &next_node->p, &next_node->p3, progress - 0.5f);
-                route->steer = route->drawinfo->heading - route->next_heading;
-            }
-            else
-            {
-                if (route->speed * 2 <= route->next_distance)
-                    bez(route->drawinfo, &next_node->p3, &next_node->p, &next_node->p1, 0.5f + (route_now - route->next_time)/TURN_TIME);
-                else	/* Short edge */
-                    bez(route->drawinfo, &next_node->p3, &next_node->p, &next_node->p1, progress - 0.5f);
-                route->steer = route->drawinfo->heading - route->next_heading;
-            }
-        }
-        else if (route->state.forwardsa && progress<0 && (last_node->p3.x || last_node->p3.z))
-        {
-            /* Leaving mirror of p3. Special handling to deal with short paths. */
-            progress = (route->last_time - route_now) / (TURN_TIME/2);
-            route->drawinfo->x = last_node->p.x + progress * (last_node->p.x - last_node->p3.x);
-            route->drawinfo->z = last_node->p.z + progress * (last_node->p.z - last_node->p3.z);
-            route->drawinfo->heading = route->next_heading;
-        }
-        else if (!route->state.forwardsa && (route_now - route->last_time < TURN_TIME/2) && (last_node->p3.x || last_node->p3.z))
+        for (n = 1; n < shares; n++)
         {
-            /* Leaving a waypoint (may be from a negative direction if a paused child) */
-            if (route->direction > 0)
-            {
-                if ((progress < 0) || (route->speed * 2 <= route->next_distance))
-                    bez(route->drawinfo, &last_node->p1, &last_node->p, &last_node->p3, 0.5f + (route_now - route->last_time)/TURN_TIME);
-                else	/* Short edge */
-                    bez(route->drawinfo, &last_node->p1, &last_node->p, &last_node->p3, progress + 0.5f);
-            }
-            else
-            {
-                if ((progress < 0) || (route->speed * 2 <= route->next_distance))
-                    bez(route->drawinfo, &last_node->p3, &last_node->p, &last_node->p1, 0.5f + (route_now - route->last_time)/TURN_TIME);
-                else	/* Short edge */
-                    bez(route->drawinfo, &last_node->p3, &last_node->p, &last_node->p1, progress + 0.5f);
-            }
-            route->steer = route->next_heading - route->drawinfo->heading;
+            drawers[n-1].routes = airport.moving + n * size;
+            drawers[n-1].count = n < shares-1 ? size : airport.movingcount - n * size;
+            event_set(&drawers[n-1].go);
         }
+        calcpositions(airport.moving, size);
+        for (n = 1; n < shares; n++)
+            event_wait(&drawers[n-1].done);
+    }
+    else
+    {
+        if (batch.count) straightbatch_run(&batch);
+        if (bezbatch.count) bezbatch_run(&bezbatch);
+    }
+
+    /* Routes that have jumped or turned abruptly aren't interpolated from their last drawing position.
+     * Routes that have stopped keep their drawing position, so go dormant until their state next changes. */
+    interval = last_frame - prev_frame;
+    for (n = nmoving = 0; n < airport.movingcount; n++)
+    {
+        XPLMDrawInfo_t *last;
+        float xdist, zdist, turn;
+
+        route = airport.moving[n];
+        last = airport.lastdrawinfo + (route->drawinfo - airport.drawinfo);
+        xdist = route->drawinfo->x - last->x;
+        zdist = route->drawinfo->z - last->z;
+        turn = route->drawinfo->heading - last->heading;
+        while (turn > 180) turn -= 360;		/* to range -180..180 */
+        while (turn < -180) turn += 360;
+        if (route->state.emerging || xdist*xdist + zdist*zdist > 4 * (route->speed * interval) * (route->speed * interval) || fabsf(turn) > 90)
+            *last = *route->drawinfo;
         else
-        {
-            route->drawinfo->x = last_node->p.x + progress * (next_node->p.x - last_node->p.x);
-            route->drawinfo->z = last_node->p.z + progress * (next_node->p.z - last_node->p.z);
-            route->drawinfo->heading = route->next_heading;
-        }
-        if (route->object.offset)
-        {
-            float h = D2R(route->drawinfo->heading);
-            route->drawinfo->x += sinf(h) * route->object.offset;
-            route->drawinfo->z -= cosf(h) * route->object.offset;
-        }
-        if (route->steer)
-            route->steer = fmodf(route->steer + 540, 360) - 180;	/* to range -180..180 */
-        route->drawinfo->heading += route->object.heading;
+            last->heading = route->drawinfo->heading - turn;	/* Interpolate the short way round */
+        route->state.emerging = 0;
+
+        if (isdormant(route))
+            route->state.dormant = 1;
+        else
+            airport.moving[nmoving++] = route;
     }
+    airport.movingcount = nmoving;
 
-    drawroutes();
+    if (shifted || !prev_frame || interval <= 0)
+        memcpy(airport.lastdrawinfo, airport.drawinfo, airport.routecount * sizeof(XPLMDrawInfo_t));	/* Nothing to interpolate from */
 
 #ifdef DO_BENCHMARK
     gettimeofday(&t2, NULL);		/* stop */
     drawcumul += (t2.tv_sec-t1.tv_sec) * 1000000 + t2.tv_usec - t1.tv_usec;
 #endif
-    return 1;
 }
 
 
-static void bez(XPLMDrawInfo_t *drawinfo, point_t *p1, point_t *p2, point_t *p3, float mu)
+/* Flight loop callback that simulates routes at SIM_RATE, independently of the frame rate */
+float simcallback(float inElapsedSinceLastCall, float inElapsedTimeSinceLastFlightLoop, int inCounter, void *inRefcon)
 {
-    float mum1, mum12, mu2;
-    float tx, tz;
+#ifndef DO_MARKERS	/* Markers are drawn during simulation, which must then happen in drawcallback() */
+    float now = XPLMGetDataf(ref_monotonic);
 
-    // assert (mu>=0 && mu<=1);	// Trains may go negative at start or in replay
+    if (!last_frame || now >= next_sim || now < last_frame)
+    {
+        simulate(now);
+        next_sim += 1/SIM_RATE;
+        if (next_sim <= now || next_sim > now + 1/SIM_RATE)
+            next_sim = now + 1/SIM_RATE;	/* Fallen behind, or time has gone backwards */
+    }
+#endif
+    return -1;	/* Every frame */
+}
+
+
+/* Interpolate this frame's drawing positions between the last two simulation steps. Draws one step in the past so
+ * that there's always a later step to interpolate towards. */
+static void interpolate(float now)
+{
+    XPLMDrawInfo_t *last = airport.lastdrawinfo, *next = airport.drawinfo, *draw = airport.framedrawinfo;
+    float alpha = 1;
+    int i;
+
+    if (last_frame > prev_frame)
+    {
+        alpha = (now - 1/SIM_RATE - prev_frame) / (last_frame - prev_frame);
+        if (alpha < 0)
+            alpha = 0;
+        else if (alpha > 1)
+            alpha = 1;
+    }
+    drawlag = (1 - alpha) * (last_frame - prev_frame);
+
+    for (i = 0; i < airport.routecount; i++)
+    {
+        draw[i].x       = last[i].x       + alpha * (next[i].x       - last[i].x);
+        draw[i].y       = last[i].y       + alpha * (next[i].y       - last[i].y);
+        draw[i].z       = last[i].z       + alpha * (next[i].z       - last[i].z);
+        draw[i].pitch   = last[i].pitch   + alpha * (next[i].pitch   - last[i].pitch);
+        draw[i].heading = last[i].heading + alpha * (next[i].heading - last[i].heading);
+        draw[i].roll    = last[i].roll    + alpha * (next[i].roll    - last[i].roll);
+    }
+
+    interpolated_time = now;
+    interpolated_step = stepcount;
+}
+
+
+/* Main draw loop */
+int drawcallback(XPLMDrawingPhase inPhase, int inIsBefore, void *inRefcon)
+{
+    dpoint_t p;
+    point_t view;
+    float now;
+    int normal, paused;
+#ifdef DO_BENCHMARK
+    struct timeval t1, t2;
+    gettimeofday(&t1, NULL);		/* start */
+#endif
+
+    assert (airport.state == active);
+
+    if ((normal = !XPLMGetDatai(ref_rentype)))
+    {
+        getlodfactor();	/* Screen size can change while paused, so need to recalculate once per frame */
+#ifdef DO_BENCHMARK
+        drawframes += 1;
+#endif
+
+        /* draw route paths */
+        if (airport.drawroutes)
+        {
+#ifdef DEBUG
+            int planeno;
+#endif
+            GLint view[4] = { 0 };
+
+            XPLMSetGraphicsState(0, 0, 0,   0, 1,   0, 0);
+            glLineWidth(1.5);
+
+            XPLMGetScreenSize(view+2, view+3);	/* Real viewport reported by GL_VIEWPORT will be larger than physical screen if FSAA enabled */
+            drawdebug3d(-1, view);
+
+#ifdef DEBUG
+            /* Draw AI plane positions */
+            glColor4f(0,0,0,0.25f);
+            glBegin(GL_QUADS);
+            for (planeno=0; planeno<count_footprints(); planeno++)
+            {
+                point_t *p;
+                int i;
+
+                if ((p = get_plane_footprint(planeno, 5.f)))	/* Display 5 seconds ahead */
+                    for (i=0; i<4; i++)
+                        glVertex3fv(&(p[i].x));
+            }
+            glEnd();
+#endif
+        }
+    }
+
+    now = XPLMGetDataf(ref_monotonic);
+    view.x = XPLMGetDataf(ref_view_x);
+    view.y = XPLMGetDataf(ref_view_y);
+    view.z = XPLMGetDataf(ref_view_z);
+    paused = (now == drawn_time);
+    if (normal) drawn_time = now;
+
+    if (!last_frame ||		/* First frame since activation */
+#ifdef DO_MARKERS
+        now != last_frame ||
+#endif
+        isshifted(&p) ||	/* Drawing positions are stale */
+        (paused && ndistant && (view.x != last_view.x || view.z != last_view.z || lod_factor != last_lod_factor || airport.drawroutes)))	/* Routes that we skipped might have come into range */
+    {
+#ifdef DO_BENCHMARK
+        gettimeofday(&t2, NULL);		/* Don't count simulation time twice */
+        drawcumul += (t2.tv_sec-t1.tv_sec) * 1000000 + t2.tv_usec - t1.tv_usec;
+#endif
+        simulate(now);
+#ifdef DO_BENCHMARK
+        gettimeofday(&t1, NULL);
+#endif
+    }
 
-    mu2 = mu * mu;
-    mum1 = 1 - mu;
-    mum12 = mum1 * mum1;
-    drawinfo->x = p1->x * mum12 + 2 * p2->x * mum1 * mu + p3->x * mu2;
-    drawinfo->z = p1->z * mum12 + 2 * p2->z * mum1 * mu + p3->z * mu2;
+    /* We can be called multiple times per frame depending on shadow settings -
+     * ("sim/graphics/view/world_render_type" = 0 if normal draw, 3 if shadow draw (which precedes normal))
+     * So only interpolate if time has moved on or we've simulated since. */
+    if (now != interpolated_time || stepcount != interpolated_step)
+        interpolate(now);
 
-    tx = 2 * mum1 * (p2->x - p1->x) + 2 * mu * (p3->x - p2->x);
-    tz =-2 * mum1 * (p2->z - p1->z) - 2 * mu * (p3->z - p2->z);
-    drawinfo->heading = R2D(atan2f(tx, tz));
+    drawroutes(&view);
+
+#ifdef DO_BENCHMARK
+    gettimeofday(&t2, NULL);		/* stop */
+    drawcumul += (t2.tv_sec-t1.tv_sec) * 1000000 + t2.tv_usec - t1.tv_usec;
+#endif
+    return 1;
 }
@@ -10,18 +10,40 @@
 
 #define CIRCLEDIV 72
 
+/* Screen co-ordinates of route nodes for labeling, for all nodes of all parent routes in order */
+static struct { int drawX, drawY; } *nodelabels = NULL;
+static int nodelabel_count = 0, nodelabel_max = 0;
+
 
 /* Draw route paths in 3d drawing phase */
 void drawdebug3d(int drawnodes, GLint view[4])
 {
     GLdouble model[16], proj[16];
-    int i;
+    int i, n = 0;
     route_t *route;
 
     /* This is slow! */
     glGetDoublev(GL_MODELVIEW_MATRIX, model);
     glGetDoublev(GL_PROJECTION_MATRIX, proj);
 
+    if (drawnodes)
+    {
+        for (nodelabel_count=0, route=airport.routes; route; route=route->next)
+            if (!route->parent) nodelabel_count += route->pathlen;
+        if (nodelabel_count > nodelabel_max)
+        {
+            void *newlabels;
+            if (!(newlabels = realloc(nodelabels, nodelabel_count * sizeof(*nodelabels))))
+                drawnodes = 0;		/* Just don't label nodes */
+            else
+            {
+                nodelabels = newlabels;
+                nodelabel_max = nodelabel_count;
+            }
+        }
+    }
+    if (!drawnodes) nodelabel_count = 0;
+
     for(route=airport.routes; route; route=route->next)
         if (!route->parent)
         {
@@ -49,14 +71,13 @@ void drawdebug3d(int drawnodes, GLint view[4])
                     gluProject(node->p.x, node->p.y, node->p.z, model, proj, view, &winX, &winY, &winZ);
                     if (winZ<=1 && winX>=0 && winX<(view[0]+view[2]) && winY>=0 && winY<(view[1]+view[3]))	/* on screen and not behind us */
                     {
-                        node->drawX = winX;
-                        node->drawY = winY;
+                        nodelabels[n].drawX = winX;
+                        nodelabels[n].drawY = winY;
                     }
                     else
-                        node->drawX = node->drawY = 0;
+                        nodelabels[n].drawX = nodelabels[n].drawY = 0;
+                    n++;
                 }
-                else
-                    node->drawX = node->drawY = 0;
             }
             glEnd();
         }
@@ -67,20 +88,17 @@ void drawdebug3d(int drawnodes, GLint view[4])
 void drawdebug2d()
 {
     float waycolor[] = { 1, 1, 1 }, routecolor[] = { 0.5f, 1, 1 };
-    int i;
+    int i, n;
     route_t *route;
 
-    for (route=airport.routes; route; route=route->next)
+    for (n=0, route=airport.routes; route && n<nodelabel_count; route=route->next)
         if (!route->parent)
-            for (i=0; i<route->pathlen; i++)
-            {
-                path_t *node = route->path + i;
-                if (node->drawX && node->drawY)
+            for (i=0; i<route->pathlen; i++, n++)
+                if (nodelabels[n].drawX && nodelabels[n].drawY)
                 {
-                    // XPLMDrawTranslucentDarkBox(node->drawX-font_width, node->drawY+font_semiheight-2, node->drawX+(strlen(labeltbl+5*i)-1)*font_width+1, node->drawY-font_semiheight-2);
-                    XPLMDrawString(waycolor, node->drawX-font_width, node->drawY-font_semiheight, labeltbl+5*i, NULL, xplmFont_Basic);
+                    // XPLMDrawTranslucentDarkBox(nodelabels[n].drawX-font_width, nodelabels[n].drawY+font_semiheight-2, nodelabels[n].drawX+(strlen(labeltbl+5*i)-1)*font_width+1, nodelabels[n].drawY-font_semiheight-2);
+                    XPLMDrawString(waycolor, nodelabels[n].drawX-font_width, nodelabels[n].drawY-font_semiheight, labeltbl+5*i, NULL, xplmFont_Basic);
                 }
-            }
 
     for (route=airport.routes; route; route=route->next)
         if (!route->parent)
@@ -99,10 +117,10 @@ void drawdebug2d()
                     sprintf(buf+off, " %d\xE2\x96\xAA" "When", route->last_node);
                 else if (route->state.paused)
                     sprintf(buf+off, " %d\xE2\x96\xAA" "Pause", route->last_node);
-                else if (route->state.collision == (collision_t*) -1)
+                else if (route->state.collision == (route_t*) -1)
                     sprintf(buf+off, " %d\xE2\xA8\xAF" "aircraft", route->last_node);	/* VECTOR OR CROSS PRODUCT */
                 else if (route->state.collision)
-                    sprintf(buf+off, " %d\xE2\xA8\xAF" "%d", route->last_node, route->state.collision->route->lineno);
+                    sprintf(buf+off, " %d\xE2\xA8\xAF" "%d", route->last_node, route->state.collision->lineno);
                 else
                     sprintf(buf+off, " %d\xE2\x9E\xA1" "%d", route->last_node, route->next_node);	/* BLACK RIGHTWARDS ARROW */
                 XPLMDrawTranslucentDarkBox(route->drawX-off*font_width, route->drawY+3*font_semiheight, route->drawX+(strlen(buf)-2-off)*font_width+1, route->drawY+font_semiheight);
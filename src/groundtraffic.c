@@ -52,8 +52,9 @@ static int intrefcallback(XPLMDataRef inRefCon);
 static int varrefcallback(XPLMDataRef inRefCon, float *outValues, int inOffset, int inMax);
 static int lookup_objects(airport_t *airport);
 static void activate2(airport_t *airport);
+static int moveroutes(airport_t *airport, route_t **routes, int count);
 static void *check_LODs(void *arg);
-static void *check_collisions(void *arg);
+static void mapsegments(airport_t *airport);
 
 
 PLUGIN_API int XPluginStart(char *outName, char *outSignature, char *outDescription)
@@ -145,6 +146,7 @@ PLUGIN_API void XPluginDisable(void)
     activating_route = NULL;	/* Discard any pending async object load */
     worker_stop(&LOD_worker);
     worker_stop(&collision_worker);
+    reset_planes();
     clearconfig(&airport);
 }
 
@@ -183,6 +185,11 @@ PLUGIN_API void XPluginReceiveMessage(XPLMPluginID inFrom, long inMessage, void
     else if (inMessage==XPLM_MSG_PLANE_LOADED)
     {
         reset_planes();
+        count_planes();		/* Start analysing the new aircraft in the background */
+    }
+    else if (inMessage==MSG_EXT_PLANES)
+    {
+        set_ext_planes(inParam);
     }
 }
 
@@ -304,37 +311,47 @@ static inline route_t *datarefroute()
 }
 
 
+/* Signed speed at which route->distance is changing */
+static inline float routespeed(route_t *route)
+{
+    if (route->state.frozen||route->state.paused||route->state.waiting||route->state.dataref||route->state.collision)
+        return 0;
+    else if (route->state.backingup)
+        return -route->speed;
+    else
+        return route->speed;
+}
+
+
 /* dataref accesor callback */
 static float floatrefcallback(XPLMDataRef inDataRef)
 {
     route_t *route;
+    float drawn;
     if (!(route = datarefroute())) return 0;
 
+    drawn = route->distance - drawlag * routespeed(route);	/* Objects are drawn drawlag behind the simulation */
     switch ((dataref_t) ((intptr_t) inDataRef))
     {
     case distance:
-        return route->distance;
+        return drawn;
     case speed:
-        if (route->state.frozen||route->state.paused||route->state.waiting||route->state.dataref||route->state.collision)
-            return 0;
-        else if (route->state.backingup)
-            return -route->speed;
-        else
-            return route->speed;
+        return routespeed(route);
     case steer:
         return route->steer;
     case node_last_distance:
-        return route->distance - route->last_distance;
+        return drawn - route->last_distance;
     case node_next_distance:
-        return route->next_distance - (route->distance - route->last_distance);
+        return route->next_distance - (drawn - route->last_distance);
 #ifdef DEBUG
     case lod:
         return route->object.drawlod * lod_factor;
     case range:
     {
-        float range_x = route->drawinfo->x - XPLMGetDataf(ref_view_x);
-        float range_y = route->drawinfo->y - XPLMGetDataf(ref_view_y);
-        float range_z = route->drawinfo->z - XPLMGetDataf(ref_view_z);
+        XPLMDrawInfo_t *drawinfo = airport.framedrawinfo + (route->drawinfo - airport.drawinfo);
+        float range_x = drawinfo->x - XPLMGetDataf(ref_view_x);
+        float range_y = drawinfo->y - XPLMGetDataf(ref_view_y);
+        float range_z = drawinfo->z - XPLMGetDataf(ref_view_z);
         return sqrtf(range_x*range_x + range_y*range_y + range_z*range_z);
     }
 #endif
@@ -560,7 +577,7 @@ int activate(airport_t *airport)
      * 5. sort routes by XPLMObjectRef for batched drawing
      *
      * (1) takes typically a few milliseconds or tens of milliseconds for a complex config.
-     * (2) can take a large number of seconds for a complex config with, say, 500 overlapping routes.
+     * (2) can take a second or so for a complex config with, say, 500 overlapping routes.
      * (3) and (4) take roughly the same time if the .obj files are loaded in the OS cache (they're both parsing
      * the same .obj files) and can take a number of seconds.
      * (5) takes a few milliseconds.
@@ -648,8 +665,8 @@ static void activate2(airport_t *airport)
     worker_wait(&collision_worker);
 
     /* Sort routes by XPLMObjectRef and assign XPLMDrawInfo_t entries in sequence so objects can be drawn in batches.
-     * Rather than actually shuffling the routes around in memory we just sort an array of pointers and then go back
-     * and fix up the linked list and pointers into the XPLMDrawInfo_t array. */
+     * We sort an array of pointers and then move the routes into a contiguous array in that order, so that the
+     * per-step walk of the route list in simulate() runs sequentially through memory. */
     for (count = 0, route = airport->routes; route; count++, route = route->next)
     {
         if (route->highway)		/* If previously deactivated, just let it continue when and where it left off */
@@ -657,14 +674,18 @@ static void activate2(airport_t *airport)
     }
     if (!airport->drawinfo)
     {
-        if (!(airport->drawinfo = calloc(count, sizeof(XPLMDrawInfo_t))))
+        if (!(airport->drawinfo = calloc(count, sizeof(XPLMDrawInfo_t))) ||
+            !(airport->lastdrawinfo = calloc(count, sizeof(XPLMDrawInfo_t))) ||
+            !(airport->framedrawinfo = calloc(count, sizeof(XPLMDrawInfo_t))))
         {
             xplog("Out of memory!");
             clearconfig(airport);
             return;
         }
-        for (i = 0; i<count; airport->drawinfo[i++].structSize = sizeof(XPLMDrawInfo_t));
+        for (i = 0; i<count; i++)
+            airport->drawinfo[i].structSize = airport->lastdrawinfo[i].structSize = airport->framedrawinfo[i].structSize = sizeof(XPLMDrawInfo_t);
     }
+    airport->routecount = count;
     if (!(routes = malloc(count * sizeof(route))))
     {
         xplog("Out of memory!");
@@ -674,16 +695,25 @@ static void activate2(airport_t *airport)
     for (i = 0, route = airport->routes; route; route = route->next)
         routes[i++] = route;
     qsort(routes, count, sizeof(route), sortroute);
-    airport->routes = routes[0];
-    for (i = 0; i < count; i++)
+    if (!moveroutes(airport, routes, count))
     {
-        routes[i]->drawinfo = airport->drawinfo + i;
-        routes[i]->next = i < count-1 ? routes[i+1] : NULL;
+        xplog("Out of memory!");
+        free(routes);
+        clearconfig(airport);
+        return;
     }
     free(routes);
+    if (!scheduleroutes(airport, count) || !partitionroutes(airport, count))
+    {
+        xplog("Out of memory!");
+        clearconfig(airport);
+        return;
+    }
+    startdrawers(airport, count);
 
     XPLMEnableFeature("XPLM_WANTS_REFLECTIONS", airport->reflections);
     XPLMRegisterDrawCallback(drawcallback, xplm_Phase_Objects, 0, NULL);	/* After other 3D objects */
+    XPLMRegisterFlightLoopCallback(simcallback, -1, NULL);	/* Every frame */
     if (airport->drawroutes)
     {
         XPLMGetFontDimensions(xplmFont_Basic, &font_width, &font_semiheight, NULL);
@@ -704,6 +734,70 @@ static void activate2(airport_t *airport)
 }
 
 
+/* Forwarding address of a route that moveroutes() has moved - left in the old route's next pointer */
+static inline route_t *movedroute(route_t *route)
+{
+    return (route && route != (route_t *) -1) ? route->next : route;
+}
+
+static inline reservation_t *movedreservation(reservation_t *reservation)
+{
+    if (!reservation)
+        return NULL;
+    else if (reservation == &reservation->route->segment_reservation)
+        return &reservation->route->next->segment_reservation;
+    else
+        return &reservation->route->next->node_reservation;
+}
+
+/* Move the routes into a new contiguous array in the order given, and fix up pointers between them.
+ * Returns 0 on OOM, in which case the routes are left where they were. */
+static int moveroutes(airport_t *airport, route_t **routes, int count)
+{
+    route_t *routetbl;
+    int i;
+
+    if (!(routetbl = malloc(count * sizeof(route_t)))) return 0;
+    for (i = 0; i < count; i++)
+    {
+        memcpy(routetbl + i, routes[i], sizeof(route_t));
+        routes[i]->next = routetbl + i;	/* Forwarding address */
+    }
+
+    for (i = 0; i < count; i++)
+    {
+        route_t *route = routetbl + i;
+        reservation_t *reservations[2] = { &route->segment_reservation, &route->node_reservation };
+        reservation_t *old[2] = { &routes[i]->segment_reservation, &routes[i]->node_reservation };
+        int r;
+
+        route->drawinfo = airport->drawinfo + i;
+        route->next = i < count-1 ? routetbl + i+1 : NULL;
+        route->parent = movedroute(route->parent);
+        route->state.collision = movedroute(route->state.collision);
+        route->waiters = movedroute(route->waiters);
+        route->next_waiter = movedroute(route->next_waiter);
+        for (r = 0; r < 2; r++)
+            if (reservations[r]->zone)
+            {
+                if (reservations[r]->zone->reservations == old[r])
+                    reservations[r]->zone->reservations = reservations[r];
+                reservations[r]->route = route;
+                reservations[r]->next = movedreservation(reservations[r]->next);
+            }
+    }
+    airport->firstroute = movedroute(airport->firstroute);
+
+    /* Free the old storage. Only the routes themselves move - the things they point to are unchanged */
+    if (airport->routetbl)
+        free(airport->routetbl);
+    else
+        for (i = 0; i < count; free(routes[i++]));
+    airport->routes = airport->routetbl = routetbl;
+    return -1;
+}
+
+
 /* Callback from XPLMLookupObjects to count library objects */
 static void countlibraryobjs(const char *inFilePath, void *inRef)
 {}	/* Don't need to do anything */
@@ -791,13 +885,8 @@ static int lookup_objects(airport_t *airport)
                 }
             }
 
-            /* Measure route path length */
-            path_dist = 0;
-            for (i=1; i<route->pathlen; i++)
-            {
-                path_t *node = route->path+i, *prev = route->path+i-1;
-                path_dist += hypotf(node->p.x - prev->p.x, node->p.z - prev->p.z);
-            }
+            /* Route path length, as measured by maproutes() */
+            path_dist = route->path[route->pathlen-1].distance;
 
             /* This route becomes the parent and always exists even if DataRef draw_cars_05 == 0 */
             {
@@ -845,6 +934,7 @@ static int lookup_objects(airport_t *airport)
                 /* Pick one at random (temporarily abuse deadlock variable as a counter) */
                 route->deadlocked = rand() % count;	/* rand() doesn't give an even distribution; I don't care */
                 XPLMLookupObjects(route->object.name, airport->tower.lat, airport->tower.lon, chooselibraryobj, route);
+                route->deadlocked = 0;
             }
             else
             {
@@ -968,112 +1058,6 @@ static void *check_LODs(void *arg)
 }
 
 
-/* Check for collisions - O(n * log(n) * m^2) ! */
-static void *check_collisions(void *arg)
-{
-    route_t *route, *other;
-#ifdef DO_BENCHMARK
-    char buffer[64];
-    struct timeval t1, t2;
-    gettimeofday(&t1, NULL);		/* start */
-#endif
-
-    for (route=airport.routes; route; route=route->next)
-    {
-        worker_check_stop(&collision_worker);
-
-        if (!route->parent && !route->highway)		/* Skip child routes and highways */
-        {
-            int rrev = route->path[route->pathlen-1].flags.reverse;
-
-            for (other=route->next; other; other=other->next)
-            {
-                int orev = other->path[other->pathlen-1].flags.reverse;
-                int r0, r1;
-
-                if (other->parent || other->highway || !bbox_intersect(&route->bbox, &other->bbox))
-                    continue;	/* Skip child routes and non-intersecting routes */
-
-                for (r0=0; r0 < route->pathlen; r0++)
-                {
-                    int o0, o1;
-                    loc_t *p0, *p1;
-                    bbox_t rbox;
-
-                    if ((r1 = r0+1) == route->pathlen)
-                    {
-                        if (rrev)
-                            break;	/* Reversible routes don't circle back */
-                        else
-                            r1=0;
-                    }
-                    p0 = &route->path[r0].waypoint;
-                    p1 = &route->path[r1].waypoint;
-                    bbox_init(&rbox);
-                    bbox_add(&rbox, p0->lat, p0->lon);
-                    bbox_add(&rbox, p1->lat, p1->lon);
-
-                    for (o0=0; o0 < other->pathlen; o0++)
-                    {
-                        loc_t *p2, *p3;
-                        bbox_t obox;
-
-                        if ((o1 = o0+1) == other->pathlen)
-                        {
-                            if (orev)
-                                break;	/* Reversible routes don't circle back */
-                            else
-                                o1=0;
-                        }
-                        p2 = &other->path[o0].waypoint;
-                        p3 = &other->path[o1].waypoint;
-                        bbox_init(&obox);
-                        bbox_add(&obox, p2->lat, p2->lon);
-                        bbox_add(&obox, p3->lat, p3->lon);
-
-                        if ((p1->lat == p3->lat && p1->lon == p3->lon) || (bbox_intersect(&rbox, &obox) && loc_intersect(p0, p1, p2, p3)))
-                        {
-                            /* Co-located path segment end nodes or segments intersect = Collision */
-                            collision_t *newc;
-
-                            if (!(newc=malloc(sizeof(collision_t))))
-                            {
-                                xplog("Out of memory!");
-                                worker_has_finished(&collision_worker);
-                                return NULL;
-                            }
-                            newc->route = other;
-                            newc->node = o0;
-                            newc->next = route->path[r0].collisions;
-                            route->path[r0].collisions = newc;
-
-                            if (!(newc=malloc(sizeof(collision_t))))
-                            {
-                                xplog("Out of memory!");
-                                worker_has_finished(&collision_worker);
-                                return NULL;
-                            }
-                            newc->route = route;
-                            newc->node = r0;
-                            newc->next = other->path[o0].collisions;
-                            other->path[o0].collisions = newc;
-                        }
-                    }
-                }
-            }
-        }
-    }
-
-#ifdef DO_BENCHMARK
-    gettimeofday(&t2, NULL);		/* stop */
-    sprintf(buffer, "%d us in activate check collisions", (int) ((t2.tv_sec-t1.tv_sec) * 1000000 + t2.tv_usec - t1.tv_usec));
-    xplog(buffer);
-#endif
-    worker_has_finished(&collision_worker);
-    return NULL;
-}
-
-
 /* No longer active - unload any resources */
 void deactivate(airport_t *airport)
 {
@@ -1102,7 +1086,9 @@ void deactivate(airport_t *airport)
     XPLMUnregisterDataAccessor(ref_varref);
     ref_varref = 0;
 
+    XPLMUnregisterFlightLoopCallback(simcallback, NULL);
     XPLMUnregisterDrawCallback(drawcallback, xplm_Phase_Objects, 0, NULL);
+    stopdrawers();
 
     airport->state=inactive;
     last_frame = 0;
@@ -1204,6 +1190,19 @@ void maproutes(airport_t *airport)
                 path->p.x=x;  path->p.y=y;  path->p.z=z;
             }
 
+            /* Segment geometry, so that waypoint transitions and highway placement are just table lookups.
+             * Assume distances are too small to care about earth curvature so just calculate using OpenGL coords */
+            for (i=0; i<route->pathlen; i++)
+            {
+                path_t *this = route->path + i;
+                path_t *next = route->path + (i+1) % route->pathlen;
+
+                this->segment_length = sqrtf((next->p.x - this->p.x) * (next->p.x - this->p.x) +
+                                             (next->p.z - this->p.z) * (next->p.z - this->p.z));
+                this->segment_heading = R2D(atan2f(next->p.x - this->p.x, this->p.z - next->p.z));
+                this->distance = i ? route->path[i-1].distance + route->path[i-1].segment_length : 0;
+            }
+
             /* Now do bezier turn points */
             for (i = reversible; i < route->pathlen - reversible; i++)
             {
@@ -1216,8 +1215,7 @@ void maproutes(airport_t *airport)
                     continue;	/* Want to be straight aligned at backing-up waypoint */
 
                 /* back */
-                dist = sqrtf((last->p.x - this->p.x) * (last->p.x - this->p.x) +
-                             (last->p.z - this->p.z) * (last->p.z - this->p.z));
+                dist = last->segment_length;
                 if (dist < route->speed * TURN_TIME)
                     ratio = 0.5f;	/* Node is too close - put control point halfway */
                 else
@@ -1226,8 +1224,7 @@ void maproutes(airport_t *airport)
                 this->p1.z = this->p.z + ratio * (last->p.z - this->p.z);
 
                 /* fwd */
-                dist = sqrtf((next->p.x - this->p.x) * (next->p.x - this->p.x) +
-                             (next->p.z - this->p.z) * (next->p.z - this->p.z));
+                dist = this->segment_length;
                 if (dist < route->speed * TURN_TIME)
                     ratio = 0.5;	/* Node is too close - put control point halfway */
                 else
@@ -1238,9 +1235,65 @@ void maproutes(airport_t *airport)
         }
         route = route->next;
     }
+
+    mapsegments(airport);
+    if (airport->moving)
+        rouseroutes(airport);	/* Dormant routes' drawing positions are now stale */
+
 #ifdef DO_BENCHMARK
     gettimeofday(&t2, NULL);		/* stop */
     sprintf(buffer, "%d us in maproutes", (int) ((t2.tv_sec-t1.tv_sec) * 1000000 + t2.tv_usec - t1.tv_usec));
     xplog(buffer);
 #endif
 }
+
+
+/* Lay a grid over the path segments of routes that are subject to collisions, so that each frame we only need to
+ * test segments in the cells that aircraft are in. Also find the furthest that we need to project aircraft footprints. */
+static void mapsegments(airport_t *airport)
+{
+    segmentgrid_t *grid = &airport->segmentgrid;
+    route_t *route;
+    float minx = FLT_MAX, minz = FLT_MAX, maxx = -FLT_MAX, maxz = -FLT_MAX, size = PLANE_CELL;
+    int i;
+
+    free(grid->plane_time);
+    grid->plane_time = NULL;
+    grid->maxtime = 0;
+    grid->marked = -1;		/* Cells need marking afresh */
+
+    for (route=airport->routes; route; route=route->next)
+    {
+        if (route->parent || route->highway) continue;	/* Skip child routes and highways */
+        for (i=0; i < route->pathlen; i++)
+        {
+            path_t *node = route->path + i;
+            float t;
+
+            if (node->p.x < minx) minx = node->p.x;
+            if (node->p.x > maxx) maxx = node->p.x;
+            if (node->p.z < minz) minz = node->p.z;
+            if (node->p.z > maxz) maxz = node->p.z;
+            if (i+1 == route->pathlen && route->path[route->pathlen-1].flags.reverse)
+                break;	/* Reversible routes don't circle back */
+            t = node->segment_length / route->speed + TURN_TIME;	/* Allow for extra turning distance */
+            if (t > grid->maxtime) grid->maxtime = t;
+        }
+    }
+    if (minx > maxx) return;	/* No routes */
+
+    if ((maxx - minx) / size >= COLLISION_MAXCELLS) size = (maxx - minx) / (COLLISION_MAXCELLS-1);
+    if ((maxz - minz) / size >= COLLISION_MAXCELLS) size = (maxz - minz) / (COLLISION_MAXCELLS-1);
+    grid->minx = minx;
+    grid->minz = minz;
+    grid->size = size;
+    grid->cols = 1 + (int) ((maxx - minx) / size);
+    grid->rows = 1 + (int) ((maxz - minz) / size);
+    if (!(grid->plane_time = malloc(grid->rows * grid->cols * sizeof(float))))
+    {
+        xplog("Out of memory!");
+        return;
+    }
+    for (i=0; i < grid->rows * grid->cols; i++)
+        grid->plane_time[i] = -1;
+}
@@ -43,6 +43,7 @@
 #  include <libgen.h>
 #  include <sys/time.h>
 #  include <pthread.h>
+#  include <unistd.h>
 #  if APL	/* https://developer.apple.com/library/mac/documentation/cocoa/Conceptual/Multithreading/ThreadSafety/ThreadSafety.html */
 #    include <libkern/OSAtomic.h>
 #    define MemoryBarrier OSMemoryBarrier
@@ -101,10 +102,21 @@
 #define TURN_TIME 2.f		/* Time [s] to execute a turn at a waypoint */
 #define AT_INTERVAL 60.f	/* How often [s] to poll for At times */
 #define WHEN_INTERVAL 1.f	/* How often [s] to poll for When DataRef values */
-#define COLLISION_INTERVAL 2.f	/* How long [s] to poll for crossing route path to become free. Also minimum spacing on overlapping segments */
-#define COLLISION_TIMEOUT ((int) 60/COLLISION_INTERVAL)	/* How many times to poll before giving up to break deadlock */
+#define COLLISION_INTERVAL 2.f	/* How long [s] to poll for route path to become free if we can't wait to be woken. Also minimum spacing on overlapping segments */
+#define COLLISION_TIMEOUT 60.f	/* How long [s] to wait to be woken before re-checking for collision anyway */
 #define COLLISION_ALT 3.f	/* Objects won't collide if their altitude differs by more than this [m] */
-#define RESET_TIME 15.f		/* If we're deactivated for longer than this then reset route timings */
+#define COLLISION_CELL 100.f	/* Minimum size of grid cells [m] used to find route path segments that might collide */
+#define COLLISION_MAXCELLS 1024	/* Arbitrary limit on number of grid cells in each direction */
+#define MAX_COLLIDERS 32	/* Max number of threads used to find collisions */
+#define SIM_RATE 20.f		/* How often [Hz] routes' states and drawing positions are updated. Interpolated in between */
+#define MAX_DRAWERS 7		/* Max number of threads, in addition to the main thread, used to calculate drawing positions */
+#define DRAWER_ROUTES 500	/* Min number of routes worth giving to another thread to calculate drawing positions */
+#define NEAR_RANGE 0.25f	/* Fraction of draw range within which drawing positions are calculated every simulation step */
+#define FAR_RANGE 0.5f		/* Fraction of draw range beyond which drawing positions are calculated every FAR_STEPS steps */
+#define MID_STEPS 2		/* How often drawing positions are calculated between NEAR_RANGE and FAR_RANGE. Extrapolated in between */
+#define FAR_STEPS 4		/* How often drawing positions are calculated beyond FAR_RANGE. Extrapolated in between */
+#define PLANE_CELL 100.f	/* Size of grid cells [m] used to find route path segments that are near aircraft */
+#define RESET_TIME 15.f		/* If a route falls further behind than this [s] then fast-forward it, or reset its timings if it can't be */
 #define MAX_VAR 10		/* How many var datarefs */
 #define HIGHWAY_VARIANCE 0.25f	/* How much to vary spacing of objects on a highway */
 
@@ -224,24 +236,45 @@ typedef struct whenref_t
 } whenref_t;
 
 
+/* A route's claim on a conflict zone for a window of time */
+struct route_t;
+struct zone_t;
+typedef struct reservation_t
+{
+    struct route_t *route;
+    struct zone_t *zone;	/* Zone reserved, or NULL if none */
+    float from, to;		/* Time window [s] */
+    struct reservation_t *next;	/* Next reservation in the same zone, in order of start time */
+} reservation_t;
+
+
+/* Times-of-day at which a waypoint's "At" command releases the route */
+typedef struct
+{
+    short times[MAX_ATTIMES];	/* minutes past midnight, terminated by INVALID_AT if fewer than MAX_ATTIMES */
+    unsigned char days;
+} attime_t;
+
+
 /* Route path - locations or commands */
-struct collision_t;
 typedef struct
 {
-    loc_t waypoint;		/* World */
     point_t p;			/* Local OpenGL co-ordinates */
     point_t p1, p3;		/* Bezier points for turn */
-    int pausetime;
-    short attime[MAX_ATTIMES];	/* minutes past midnight */
-    unsigned char atdays;
+    float segment_length;	/* Length of the segment from here to the next node [m] */
+    float segment_heading;	/* Heading of the segment from here to the next node [degrees] */
+    float distance;		/* Cumulative distance along the path from the first node to here [m] */
     struct {
         int reverse : 1;	/* Reverse whole route */
         int backup : 1;		/* Just reverse to next node */
     } flags;
-    struct collision_t *collisions;	/* Collisions with other routes */
+    int pausetime;
+    attime_t *attime;		/* NULL if no At command */
     setcmd_t *setcmds;
     whenref_t *whenrefs;
-    int drawX, drawY;		/* For labeling nodes */
+    int segment_zone;		/* Conflict zone of the segment from here to the next node - index into airport.zones, or -1 */
+    int node_zone;		/* Conflict zone of this node's location - index into airport.zones, or -1 */
+    loc_t waypoint;		/* World */
 } path_t;
 
 typedef struct
@@ -251,25 +284,20 @@ typedef struct
 
 typedef struct
 {
-    char *name;
-    char *physical_name;
     XPLMObjectRef objref;
     float drawlod;		/* Multiply by lod_factor to get draw distance */
     float lag;			/* time lag. [m] in train defn, [s] in route */
     float offset;		/* offset applied after rotation before drawing. [m] */
     float heading;		/* rotation applied before drawing */
+    char *name;
+    char *physical_name;
 } objdef_t;
 
 /* A route from routes.txt */
-struct collision_t;
 struct highway_t;
 typedef struct route_t
 {
-    int lineno;			/* Source line in GroundTraffic.txt */
-    objdef_t object;
-    path_t *path;
-    int pathlen;
-    bbox_t bbox;		/* Bounding box of path */
+    /* Hot - read every frame while drawing */
     struct
     {
         int frozen : 1;		/* Child whose parent is waiting */
@@ -280,29 +308,51 @@ typedef struct route_t
         int backingup : 1;
         int forwardsa : 1;	/* Waypoint after backing up */
         int hasdataref: 1;	/* Does the object on this route have DataRef callbacks? */
-        struct collision_t *collision;	/* Waiting for this collision to resolve */
+        int lineup : 1;		/* Child whose parent has been fast-forwarded, so needs to line up behind it */
+        int dormant : 1;	/* Stopped, so not in airport.moving */
+        int distant : 1;	/* Beyond draw range, so drawing position not calculated at this step */
+        int emerging : 1;	/* Came back into draw range at this step, so nothing to interpolate from */
+        int reduced : 1;	/* Drawing position calculated at a reduced rate and extrapolated in between */
+        int extrapolating : 1;	/* vx and vz are valid */
+        struct route_t *collision;	/* Waiting for this route to move, or -1 for a plane */
     } state;
     int direction;		/* Traversing path 1=forwards, -1=reverse */
     int last_node, next_node;	/* The last and next waypoints visited on the path */
     float last_time, next_time;	/* Time we left last_node, expected time to hit the next node */
     float freeze_time;		/* For children: Time when parent started pause */
+    float draw_time;		/* Time at which we're drawn in this frame - in the past for train objects */
     float speed;		/* [m/s] */
     float last_distance;	/* Cumulative distance travelled from first to last_node [m] */
     float next_distance;	/* Distance from last_node to next_node [m] */
     float distance;		/* Cumulative distance travelled from first node [m] */
     float next_heading;		/* Heading from last_node to next_node [m] */
     float steer;		/* Approximate steer angle (degrees) while turning */
-    glColor3f_t drawcolor;	/* debug path color */
-    int drawX, drawY;		/* debug label position */
-    XPLMDrawInfo_t *drawinfo;	/* Where to draw - current OpenGL co-ordinates */
     float last_probe, next_probe;	/* Time of last altitude probe and when we should probe again */
     float last_y, next_y;	/* OpenGL co-ordinates at last and next probe points */
-    int deadlocked;		/* Counter used to break collision deadlock */
-    float highway_offset;	/* For highway children: Starting offset from start of route */
-    struct highway_t *highway;	/* Is a highway */
-    userref_t (*varrefs)[MAX_VAR];	/* Per-route var dataref */
+    int children;		/* Index in airport.children of the children of this parent, or -1. Not hot, but fills padding */
+    float vx, vz;		/* Velocity [m/s] at the last calculation of drawing position, for extrapolating */
+    path_t *path;
+    int pathlen;
+    int event;			/* Index in airport.events, or -1 if not scheduled. Not hot, but fills padding */
+    XPLMDrawInfo_t *drawinfo;	/* Where to draw - current OpenGL co-ordinates */
     struct route_t *parent;	/* Points to head of a train */
+    struct highway_t *highway;	/* Is a highway */
     struct route_t *next;
+    objdef_t object;
+
+    /* Cold - only used at waypoints, for collisions, or for debugging */
+    float collision_delay;	/* How long [s] to wait before re-checking a collision if not woken first */
+    int deadlocked;		/* Chosen to break a collision deadlock, so ignore other routes at next check */
+    struct route_t *waiters;	/* Routes waiting for this route to move */
+    struct route_t *next_waiter;	/* Next route waiting for the same route */
+    reservation_t segment_reservation;	/* Segment that we're on */
+    reservation_t node_reservation;	/* Node that we're heading for or waiting at */
+    float highway_offset;	/* For highway children: Starting offset from start of route */
+    int lineno;			/* Source line in GroundTraffic.txt */
+    bbox_t bbox;		/* Bounding box of path */
+    glColor3f_t drawcolor;	/* debug path color */
+    short drawX, drawY;		/* debug label position */
+    userref_t (*varrefs)[MAX_VAR];	/* Per-route var dataref */
 } route_t;
 
 
@@ -328,13 +378,56 @@ typedef struct highway_t
 } highway_t;
 
 
-/* Collision between routes */
-typedef struct collision_t
+/* Conflict zone - a unique route path segment or node location */
+typedef struct zone_t
+{
+    reservation_t *reservations;	/* In order of start time */
+    int *conflicts;	/* Segment zones that this segment zone collides with, including itself - slice of airport.conflicts */
+    int conflict_count;
+} zone_t;
+
+
+/* Grid over route path segments in local OpenGL co-ordinates, for finding segments that are near aircraft */
+typedef struct
+{
+    float minx, minz;
+    float size;			/* Cell size [m] */
+    int cols, rows;		/* x, z */
+    float *plane_time;		/* Frame time at which an aircraft was last in each cell */
+    float marked;		/* Frame in which we last marked cells, or -1 if the grid has been rebuilt since */
+    float maxtime;		/* Longest time [s] that any route takes to traverse a segment */
+} segmentgrid_t;
+
+
+/* Routes on the straight part of a segment, gathered during simulate() so that their drawing positions can be
+ * calculated a batch at a time. One lane per route. */
+#define BATCH_LANES 8		/* Multiple of SIMD width */
+typedef struct
 {
-    route_t *route;	/* Other route */
-    int node;		/* Other node (assuming forwards direction) */
-    struct collision_t *next;
-} collision_t;
+    int count;
+    XPLMDrawInfo_t *drawinfo[BATCH_LANES];	/* Where to put the results */
+    float progress[BATCH_LANES];	/* Fraction of the segment travelled */
+    float x0[BATCH_LANES], z0[BATCH_LANES], dx[BATCH_LANES], dz[BATCH_LANES];	/* Segment start and extent */
+    float climb[BATCH_LANES], run[BATCH_LANES];	/* Probed gradient, for pitch */
+    float pitchsign[BATCH_LANES];	/* 1 or -1 to pitch the object with the gradient, 0 to leave its pitch alone */
+    float heading[BATCH_LANES];		/* Segment heading [degrees] */
+    float offset[BATCH_LANES];		/* Object offset along heading [m] */
+} straightbatch_t;
+
+/* Routes turning through a waypoint, gathered during simulate() so that their positions on the bezier curve can be
+ * calculated a batch at a time. One lane per route. */
+typedef struct
+{
+    int count;
+    XPLMDrawInfo_t *drawinfo[BATCH_LANES];	/* Where to put the results */
+    float *steer[BATCH_LANES];		/* Where to put the steering angle */
+    float p1x[BATCH_LANES], p1z[BATCH_LANES], p2x[BATCH_LANES], p2z[BATCH_LANES], p3x[BATCH_LANES], p3z[BATCH_LANES];	/* Control points */
+    float mu[BATCH_LANES];		/* Fraction of the curve travelled */
+    float steersign[BATCH_LANES], steerbase[BATCH_LANES];	/* steer = steersign * curve heading + steerbase */
+    float hadjust[BATCH_LANES];		/* Added to curve heading, e.g. -180 if backing up [degrees] */
+    float offset[BATCH_LANES];		/* Object offset along heading [m] */
+    float objheading[BATCH_LANES];	/* Object heading [degrees] */
+} bezbatch_t;
 
 
 /* airport info from routes.txt */
@@ -350,11 +443,26 @@ typedef struct
     int reflections;
     float active_distance;
     route_t *routes;
+    route_t *routetbl;		/* consolidated route_t array holding all routes in draw order, once activated */
     route_t *firstroute;
     train_t *trains;
     userref_t *userrefs;
     extref_t *extrefs;
-    XPLMDrawInfo_t *drawinfo;	/* consolidated XPLMDrawInfo_t array for all routes/objects so they can be batched */
+    zone_t *zones;		/* Conflict zones for all route segments and nodes */
+    int *conflicts;		/* consolidated conflict array for all segment zones */
+    segmentgrid_t segmentgrid;	/* Route path segments that are subject to collisions with aircraft */
+    XPLMDrawInfo_t *drawinfo;	/* consolidated XPLMDrawInfo_t array for all routes/objects at the last simulation step */
+    XPLMDrawInfo_t *lastdrawinfo;	/* ditto at the simulation step before that */
+    XPLMDrawInfo_t *framedrawinfo;	/* ditto interpolated for this frame, so they can be batched */
+    int routecount;		/* Number of entries in the above */
+    route_t **events;		/* Min-heap of routes ordered by when they're next due to change state */
+    int eventcount;
+    route_t **due;		/* Routes due to change state at this step */
+    route_t **moving;		/* Routes that aren't dormant, in draw order */
+    int movingcount;
+    route_t **woken;		/* Dormant routes roused in this frame */
+    int wokencount;
+    route_t **children;		/* NULL-terminated lists of each parent's children */
 } airport_t;
 
 
@@ -375,6 +483,18 @@ typedef struct __attribute__((aligned(64)))
     int finished;
 } worker_t;
 
+/* Auto-reset event for waking a thread */
+typedef struct
+{
+#if IBM
+    HANDLE handle;
+#else
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    int signalled;
+#endif
+} event_t;
+
 
 /* prototypes */
 int activate(airport_t *airport);
@@ -387,8 +507,19 @@ int xplog(char *msg);
 int readconfig(char *pkgpath, airport_t *airport);
 void clearconfig(airport_t *airport);
 
+void *check_collisions(void *arg);
+
+void straightbatch_run(straightbatch_t *batch);
+void bezbatch_run(bezbatch_t *batch);
+
 void labelcallback(XPLMWindowID inWindowID, void *inRefcon);
 int drawcallback(XPLMDrawingPhase inPhase, int inIsBefore, void *inRefcon);
+float simcallback(float inElapsedSinceLastCall, float inElapsedTimeSinceLastFlightLoop, int inCounter, void *inRefcon);
+int scheduleroutes(airport_t *airport, int count);
+int partitionroutes(airport_t *airport, int count);
+void rouseroutes(airport_t *airport);
+void startdrawers(airport_t *airport, int count);
+void stopdrawers();
 
 void drawdebug3d(int drawnodes, GLint view[4]);
 void drawdebug2d();
@@ -405,6 +536,7 @@ extern float lod_bias;
 extern airport_t airport;
 extern route_t *drawroute;	/* Global so can be accessed in dataref callback */
 extern int year;		/* Current year (in GMT tz) */
+extern worker_t collision_worker;
 #ifdef DO_BENCHMARK
 extern int drawcumul;
 extern int drawframes;
@@ -412,6 +544,7 @@ extern int drawframes;
 
 extern float last_frame;	/* Global so can be reset while disabled */
 extern float lod_factor;
+extern float drawlag;
 extern char *labeltbl;
 extern int font_width, font_semiheight;
 
@@ -533,16 +666,18 @@ static inline int gettimeofday(struct timeval *tp, void *tzp)
 
 /* Operations on worker_t */
 
+/* Start worker. start_routine is passed a pointer to the worker */
 static inline int worker_start(worker_t *worker, void *(*start_routine)(void *))
 {
     worker->die_please = worker->finished = 0;
     MemoryBarrier();
 #if IBM
-    if (!(worker->thread = CreateThread(NULL, 0, (LPTHREAD_START_ROUTINE) start_routine, NULL, 0, NULL)))
+    if (!(worker->thread = CreateThread(NULL, 0, (LPTHREAD_START_ROUTINE) start_routine, worker, 0, NULL)))
 #else
-    if (pthread_create(&worker->thread, NULL, start_routine, NULL))
+    if (pthread_create(&worker->thread, NULL, start_routine, worker))
 #endif
     {
+        worker->thread = 0;
         return xplog("Internal error: Can't create worker thread");
     }
     return -1;
@@ -592,6 +727,75 @@ static inline int worker_is_finished(worker_t *worker)
         return -1;
 }
 
+/* Operations on event_t */
+
+static inline int event_init(event_t *event)
+{
+#if IBM
+    return (event->handle = CreateEvent(NULL, FALSE, FALSE, NULL)) ? -1 : 0;
+#else
+    event->signalled = 0;
+    if (pthread_mutex_init(&event->mutex, NULL))
+        return 0;
+    else if (pthread_cond_init(&event->cond, NULL))
+    {
+        pthread_mutex_destroy(&event->mutex);
+        return 0;
+    }
+    return -1;
+#endif
+}
+
+static inline void event_destroy(event_t *event)
+{
+#if IBM
+    CloseHandle(event->handle);
+#else
+    pthread_cond_destroy(&event->cond);
+    pthread_mutex_destroy(&event->mutex);
+#endif
+}
+
+/* Wake the thread waiting on the event, or the next thread to wait on it */
+static inline void event_set(event_t *event)
+{
+#if IBM
+    SetEvent(event->handle);
+#else
+    pthread_mutex_lock(&event->mutex);
+    event->signalled = -1;
+    pthread_cond_signal(&event->cond);
+    pthread_mutex_unlock(&event->mutex);
+#endif
+}
+
+/* Wait for the event to be set, and reset it */
+static inline void event_wait(event_t *event)
+{
+#if IBM
+    WaitForSingleObject(event->handle, INFINITE);
+#else
+    pthread_mutex_lock(&event->mutex);
+    while (!event->signalled)
+        pthread_cond_wait(&event->cond, &event->mutex);
+    event->signalled = 0;
+    pthread_mutex_unlock(&event->mutex);
+#endif
+}
+
+/* Number of processors available for workers */
+static inline int cpu_count()
+{
+#if IBM
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors > 0 ? info.dwNumberOfProcessors : 1;
+#else
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return count > 0 ? count : 1;
+#endif
+}
+
 /* Called from worker thread to check for early termination */
 #define worker_check_stop(worker) { MemoryBarrier(); if ((*(worker)).die_please) return NULL; }
 
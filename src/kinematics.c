@@ -0,0 +1,222 @@
+/*
+ * GroundTraffic
+ *
+ * (c) Jonathan Harris 2013-2014
+ *
+ * Licensed under GNU LGPL v2.1.
+ */
+
+/* Batched calculation of drawing positions for routes whose positions can be calculated independently of
+ * each other and of the sim, so that the work can be done four routes at a time. */
+
+#include "groundtraffic.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#  include <emmintrin.h>
+#  define USE_SSE2
+#endif
+
+
+#ifdef USE_SSE2
+
+/* sin and cos of four angles [radians]. Cephes single-precision polynomials; error ~1e-7 for |x| < 1000. */
+static inline void sincos4(__m128 x, __m128 *s, __m128 *c)
+{
+    __m128 q, r, z, sr, cr, swap;
+    __m128i qi;
+
+    qi = _mm_cvtps_epi32(_mm_mul_ps(x, _mm_set1_ps((float) (2/M_PI))));	/* Nearest quadrant */
+    q = _mm_cvtepi32_ps(qi);
+    r = _mm_sub_ps(x, _mm_mul_ps(q, _mm_set1_ps(1.5703125f)));		/* Cody-Waite reduction to [-pi/4, pi/4] */
+    r = _mm_sub_ps(r, _mm_mul_ps(q, _mm_set1_ps(4.837512969970703125e-4f)));
+    r = _mm_sub_ps(r, _mm_mul_ps(q, _mm_set1_ps(7.54978995489188216e-8f)));
+    z = _mm_mul_ps(r, r);
+
+    sr = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(-1.9515295891e-4f), z), _mm_set1_ps(8.3321608736e-3f));
+    sr = _mm_add_ps(_mm_mul_ps(sr, z), _mm_set1_ps(-1.6666654611e-1f));
+    sr = _mm_add_ps(_mm_mul_ps(_mm_mul_ps(sr, z), r), r);
+
+    cr = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(2.443315711809948e-5f), z), _mm_set1_ps(-1.388731625493765e-3f));
+    cr = _mm_add_ps(_mm_mul_ps(cr, z), _mm_set1_ps(4.166664568298827e-2f));
+    cr = _mm_add_ps(_mm_sub_ps(_mm_mul_ps(_mm_mul_ps(cr, z), z), _mm_mul_ps(z, _mm_set1_ps(0.5f))), _mm_set1_ps(1));
+
+    /* Odd quadrants swap sin and cos. sin changes sign in quadrants 2 & 3, cos in quadrants 1 & 2. */
+    swap = _mm_castsi128_ps(_mm_cmpeq_epi32(_mm_and_si128(qi, _mm_set1_epi32(1)), _mm_set1_epi32(1)));
+    *s = _mm_or_ps(_mm_and_ps(swap, cr), _mm_andnot_ps(swap, sr));
+    *c = _mm_or_ps(_mm_and_ps(swap, sr), _mm_andnot_ps(swap, cr));
+    *s = _mm_xor_ps(*s, _mm_castsi128_ps(_mm_slli_epi32(_mm_and_si128(qi, _mm_set1_epi32(2)), 30)));
+    *c = _mm_xor_ps(*c, _mm_castsi128_ps(_mm_slli_epi32(_mm_and_si128(_mm_add_epi32(qi, _mm_set1_epi32(1)), _mm_set1_epi32(2)), 30)));
+}
+
+
+/* atan2 of four pairs [radians]. Minimax polynomial on [0, 1] with octant reduction; error < 0.02 degrees. */
+static inline __m128 atan2_4(__m128 y, __m128 x)
+{
+    __m128 signmask = _mm_set1_ps(-0.f);
+    __m128 ax = _mm_andnot_ps(signmask, x);
+    __m128 ay = _mm_andnot_ps(signmask, y);
+    __m128 swap = _mm_cmpgt_ps(ay, ax);
+    __m128 a, s, r;
+
+    a = _mm_div_ps(_mm_min_ps(ax, ay), _mm_max_ps(_mm_max_ps(ax, ay), _mm_set1_ps(FLT_MIN)));
+    s = _mm_mul_ps(a, a);
+    r = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(-0.0464964749f), s), _mm_set1_ps(0.15931422f));
+    r = _mm_add_ps(_mm_mul_ps(r, s), _mm_set1_ps(-0.327622764f));
+    r = _mm_add_ps(_mm_mul_ps(_mm_mul_ps(r, s), a), a);
+
+    r = _mm_or_ps(_mm_and_ps(swap, _mm_sub_ps(_mm_set1_ps((float) (M_PI/2)), r)), _mm_andnot_ps(swap, r));
+    r = _mm_or_ps(_mm_and_ps(_mm_cmplt_ps(x, _mm_setzero_ps()), _mm_sub_ps(_mm_set1_ps((float) M_PI), r)), _mm_andnot_ps(_mm_cmplt_ps(x, _mm_setzero_ps()), r));
+    return _mm_xor_ps(r, _mm_and_ps(signmask, y));
+}
+
+
+/* Calculate drawing positions for all routes in the batch, then empty the batch. Unused lanes are calculated too but
+ * the results discarded. */
+void straightbatch_run(straightbatch_t *batch)
+{
+    int i, j;
+
+    for (i = 0; i < batch->count; i += 4)
+    {
+        float x[4], z[4], pitch[4];
+        __m128 progress = _mm_loadu_ps(batch->progress + i);
+        __m128 offset = _mm_loadu_ps(batch->offset + i);
+        __m128 vx = _mm_add_ps(_mm_loadu_ps(batch->x0 + i), _mm_mul_ps(progress, _mm_loadu_ps(batch->dx + i)));
+        __m128 vz = _mm_add_ps(_mm_loadu_ps(batch->z0 + i), _mm_mul_ps(progress, _mm_loadu_ps(batch->dz + i)));
+        __m128 s, c, ps, pc;
+
+        /* Offset is applied along the segment heading, before the object's heading is added. Most objects don't have one. */
+        if (_mm_movemask_ps(_mm_cmpneq_ps(offset, _mm_setzero_ps())))
+        {
+            sincos4(_mm_mul_ps(_mm_loadu_ps(batch->heading + i), _mm_set1_ps((float) (M_PI/180))), &s, &c);
+            vx = _mm_add_ps(vx, _mm_mul_ps(s, offset));
+            vz = _mm_sub_ps(vz, _mm_mul_ps(c, offset));
+        }
+        _mm_storeu_ps(x, vx);
+        _mm_storeu_ps(z, vz);
+
+        sincos4(_mm_div_ps(_mm_loadu_ps(batch->climb + i), _mm_loadu_ps(batch->run + i)), &ps, &pc);
+        _mm_storeu_ps(pitch, _mm_mul_ps(_mm_mul_ps(ps, _mm_set1_ps((float) (180/M_PI))), _mm_loadu_ps(batch->pitchsign + i)));
+
+        for (j = 0; j < 4 && i + j < batch->count; j++)
+        {
+            XPLMDrawInfo_t *drawinfo = batch->drawinfo[i + j];
+            drawinfo->x = x[j];
+            drawinfo->z = z[j];
+            if (batch->pitchsign[i + j]) drawinfo->pitch = pitch[j];
+        }
+    }
+    batch->count = 0;
+}
+
+
+/* Calculate positions on the bezier curves, headings and steering angles for all routes in the batch, then empty the
+ * batch. Unused lanes are calculated too but the results discarded. */
+void bezbatch_run(bezbatch_t *batch)
+{
+    int i, j;
+
+    for (i = 0; i < batch->count; i += 4)
+    {
+        float x[4], z[4], heading[4], steer[4];
+        __m128 two = _mm_set1_ps(2);
+        __m128 mu = _mm_loadu_ps(batch->mu + i);
+        __m128 mum1 = _mm_sub_ps(_mm_set1_ps(1), mu);
+        __m128 mum12 = _mm_mul_ps(mum1, mum1);
+        __m128 mumu2 = _mm_mul_ps(_mm_mul_ps(two, mum1), mu);
+        __m128 mu2 = _mm_mul_ps(mu, mu);
+        __m128 p1x = _mm_loadu_ps(batch->p1x + i), p2x = _mm_loadu_ps(batch->p2x + i), p3x = _mm_loadu_ps(batch->p3x + i);
+        __m128 p1z = _mm_loadu_ps(batch->p1z + i), p2z = _mm_loadu_ps(batch->p2z + i), p3z = _mm_loadu_ps(batch->p3z + i);
+        __m128 offset = _mm_loadu_ps(batch->offset + i);
+        __m128 vx, vz, tx, tz, h, st, s, c;
+
+        vx = _mm_add_ps(_mm_add_ps(_mm_mul_ps(p1x, mum12), _mm_mul_ps(p2x, mumu2)), _mm_mul_ps(p3x, mu2));
+        vz = _mm_add_ps(_mm_add_ps(_mm_mul_ps(p1z, mum12), _mm_mul_ps(p2z, mumu2)), _mm_mul_ps(p3z, mu2));
+
+        /* Tangent gives the heading */
+        tx = _mm_mul_ps(two, _mm_add_ps(_mm_mul_ps(mum1, _mm_sub_ps(p2x, p1x)), _mm_mul_ps(mu, _mm_sub_ps(p3x, p2x))));
+        tz = _mm_mul_ps(two, _mm_add_ps(_mm_mul_ps(mum1, _mm_sub_ps(p1z, p2z)), _mm_mul_ps(mu, _mm_sub_ps(p2z, p3z))));
+        h = _mm_mul_ps(atan2_4(tx, tz), _mm_set1_ps((float) (180/M_PI)));
+
+        /* Steering angle, to range -180..180 */
+        st = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_loadu_ps(batch->steersign + i), h), _mm_loadu_ps(batch->steerbase + i)), _mm_set1_ps(540));
+        st = _mm_sub_ps(st, _mm_mul_ps(_mm_cvtepi32_ps(_mm_cvttps_epi32(_mm_mul_ps(st, _mm_set1_ps(1.f/360)))), _mm_set1_ps(360)));
+        _mm_storeu_ps(steer, _mm_sub_ps(st, _mm_set1_ps(180)));
+
+        h = _mm_add_ps(h, _mm_loadu_ps(batch->hadjust + i));
+        if (_mm_movemask_ps(_mm_cmpneq_ps(offset, _mm_setzero_ps())))
+        {
+            sincos4(_mm_mul_ps(h, _mm_set1_ps((float) (M_PI/180))), &s, &c);
+            vx = _mm_add_ps(vx, _mm_mul_ps(s, offset));
+            vz = _mm_sub_ps(vz, _mm_mul_ps(c, offset));
+        }
+        _mm_storeu_ps(x, vx);
+        _mm_storeu_ps(z, vz);
+        _mm_storeu_ps(heading, _mm_add_ps(h, _mm_loadu_ps(batch->objheading + i)));
+
+        for (j = 0; j < 4 && i + j < batch->count; j++)
+        {
+            XPLMDrawInfo_t *drawinfo = batch->drawinfo[i + j];
+            drawinfo->x = x[j];
+            drawinfo->z = z[j];
+            drawinfo->heading = heading[j];
+            *batch->steer[i + j] = steer[j];
+        }
+    }
+    batch->count = 0;
+}
+
+#else	/* !USE_SSE2 */
+
+/* Calculate drawing positions for all routes in the batch, then empty the batch */
+void straightbatch_run(straightbatch_t *batch)
+{
+    int i;
+
+    for (i = 0; i < batch->count; i++)
+    {
+        XPLMDrawInfo_t *drawinfo = batch->drawinfo[i];
+        float h = D2R(batch->heading[i]);
+
+        drawinfo->x = batch->x0[i] + batch->progress[i] * batch->dx[i] + sinf(h) * batch->offset[i];
+        drawinfo->z = batch->z0[i] + batch->progress[i] * batch->dz[i] - cosf(h) * batch->offset[i];
+        if (batch->pitchsign[i])
+            drawinfo->pitch = batch->pitchsign[i] * R2D(sinf(batch->climb[i] / batch->run[i]));
+    }
+    batch->count = 0;
+}
+
+
+/* Calculate positions on the bezier curves, headings and steering angles for all routes in the batch, then empty the
+ * batch */
+void bezbatch_run(bezbatch_t *batch)
+{
+    int i;
+
+    for (i = 0; i < batch->count; i++)
+    {
+        XPLMDrawInfo_t *drawinfo = batch->drawinfo[i];
+        float mu = batch->mu[i], mum1 = 1 - mu;
+        float tx, tz, h;
+
+        drawinfo->x = batch->p1x[i] * mum1 * mum1 + 2 * batch->p2x[i] * mum1 * mu + batch->p3x[i] * mu * mu;
+        drawinfo->z = batch->p1z[i] * mum1 * mum1 + 2 * batch->p2z[i] * mum1 * mu + batch->p3z[i] * mu * mu;
+
+        tx = 2 * mum1 * (batch->p2x[i] - batch->p1x[i]) + 2 * mu * (batch->p3x[i] - batch->p2x[i]);
+        tz =-2 * mum1 * (batch->p2z[i] - batch->p1z[i]) - 2 * mu * (batch->p3z[i] - batch->p2z[i]);
+        h = R2D(atan2f(tx, tz));
+
+        *batch->steer[i] = fmodf(batch->steersign[i] * h + batch->steerbase[i] + 540, 360) - 180;	/* to range -180..180 */
+
+        h += batch->hadjust[i];
+        if (batch->offset[i])
+        {
+            drawinfo->x += sinf(D2R(h)) * batch->offset[i];
+            drawinfo->z -= cosf(D2R(h)) * batch->offset[i];
+        }
+        drawinfo->heading = h + batch->objheading[i];
+    }
+    batch->count = 0;
+}
+
+#endif	/* USE_SSE2 */
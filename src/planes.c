@@ -11,20 +11,86 @@
 
 /* Globals */
 static const char sep[]=" \t\r\n";
-static int plane_count = 0;
-static plane_ref_t plane_refs[MAX_PLANES] = {0};
-static plane_acf_t plane_info[MAX_PLANES] = {0};
+static int plane_count = 0;	/* Number of aircraft, or 0 if they need to be re-counted */
+static int plane_max = 0;	/* Number of aircraft that we've allocated space and looked up DataRefs for */
+static plane_ref_t *plane_refs = NULL;
+static plane_acf_t *plane_info = NULL;
+static plane_footprint_t *plane_footprints = NULL;
+static int footprints_valid = 0;
+static worker_t acf_worker = { 0 };
+static acf_job_t *acf_jobs = NULL;	/* ACF files to analyse, one per aircraft */
+static int acf_count = 0;		/* Number of jobs given to acf_worker, or 0 if it's not running */
+static acf_cache_t *acf_cache = NULL;	/* ACF files that we've analysed. Only accessed from acf_worker */
+static int acf_cache_count = 0, acf_cache_max = 0, acf_cache_loaded = 0;
+static int acf_cache_dirty = 0;		/* Cache file needs rewriting from acf_cache */
+static ext_plane_t *ext_planes = NULL;	/* Aircraft supplied by another plugin */
+static plane_footprint_t *ext_footprints = NULL;
+static int ext_count = 0, ext_max = 0, ext_ai = 0;
+static float ext_time = -1;		/* When ext_planes were last supplied */
+static int footprint_sim = 0;		/* Number of the sim's aircraft in this frame's snapshot */
+static int footprint_count = 0;		/* Number of footprints in this frame's snapshot, including ext_planes */
 
 /* In this file */
 static void read_v10_plane(FILE *h, int platform, plane_acf_t *info);
 static void read_old_plane(FILE *h, int platform, plane_acf_t *info);
+static void *read_planes(void *arg);
 
-int setup_plane_refs()
+/* Look up an AI aircraft's DataRefs. Returns 0 if the sim doesn't publish them for this aircraft */
+static int setup_ai_plane_refs(plane_ref_t *plane_ref, int planeno)
+{
+    char name[64], *c;
+
+    c = name + sprintf(name, "sim/multiplayer/position/plane%d_", planeno);
+    strcpy(c, "x");           if (!(plane_ref->x   = XPLMFindDataRef(name))) return 0;
+    strcpy(c, "y");           if (!(plane_ref->y   = XPLMFindDataRef(name))) return 0;
+    strcpy(c, "z");           if (!(plane_ref->z   = XPLMFindDataRef(name))) return 0;
+    strcpy(c, "v_x");         if (!(plane_ref->vx  = XPLMFindDataRef(name))) return 0;
+    strcpy(c, "v_z");         if (!(plane_ref->vz  = XPLMFindDataRef(name))) return 0;
+    strcpy(c, "psi");         if (!(plane_ref->hdg = XPLMFindDataRef(name))) return 0;
+    strcpy(c, "gear_deploy"); if (!(plane_ref->gear= XPLMFindDataRef(name))) return 0;
+    return -1;
+}
+
+
+/* Make room for more aircraft, looking up DataRefs for the new ones. Returns 0 on OOM */
+static int grow_planes(int count)
 {
+    plane_ref_t *refs;
+    plane_acf_t *info;
+    plane_footprint_t *footprints;
+    acf_job_t *jobs;
     int i;
+
+    if (count <= plane_max) return -1;
+    if (!(refs = realloc(plane_refs, count * sizeof(plane_ref_t)))) return 0;
+    plane_refs = refs;
+    if (!(info = realloc(plane_info, count * sizeof(plane_acf_t)))) return 0;
+    plane_info = info;
+    if (!(footprints = realloc(plane_footprints, count * sizeof(plane_footprint_t)))) return 0;
+    plane_footprints = footprints;
+    if (!(jobs = realloc(acf_jobs, count * sizeof(acf_job_t)))) return 0;
+    acf_jobs = jobs;
+
+    memset(plane_refs + plane_max, 0, (count - plane_max) * sizeof(plane_ref_t));
+    memset(plane_info + plane_max, 0, (count - plane_max) * sizeof(plane_acf_t));
+    memset(plane_footprints + plane_max, 0, (count - plane_max) * sizeof(plane_footprint_t));
+    memset(acf_jobs + plane_max, 0, (count - plane_max) * sizeof(acf_job_t));
+    for (i = plane_max ? plane_max : 1; i < count; i++)
+        if (!setup_ai_plane_refs(plane_refs + i, i))
+            plane_refs[i].x = NULL;	/* get_plane_pos() will ignore this aircraft */
+    plane_max = count;
+    return -1;
+}
+
+
+/* Look up the user's aircraft's DataRefs. AI aircraft are looked up as they appear. */
+int setup_plane_refs()
+{
     plane_ref_t *plane_ref;
     char name[64], *c;
 
+    if (!grow_planes(1)) return 0;
+
     /* User's aircraft */
     c = name + sprintf(name, "sim/flightmodel/position/");
     plane_ref = plane_refs + 0;
@@ -37,73 +103,250 @@ int setup_plane_refs()
     strcpy(c, "psi");         if (!(plane_ref->hdg = XPLMFindDataRef(name))) return 0;
     if (!(plane_ref->gear= XPLMFindDataRef("sim/aircraft/parts/acf_gear_deploy"))) return 0;
 
-    /* AI aircraft */
-    for (i=1; i<MAX_PLANES; i++)
-    {
-        c = name + sprintf(name, "sim/multiplayer/position/plane%d_", i);
-        plane_ref = plane_refs + i;
-
-        strcpy(c, "x");           if (!(plane_ref->x   = XPLMFindDataRef(name))) return 0;
-        strcpy(c, "y");           if (!(plane_ref->y   = XPLMFindDataRef(name))) return 0;
-        strcpy(c, "z");           if (!(plane_ref->z   = XPLMFindDataRef(name))) return 0;
-        strcpy(c, "v_x");         if (!(plane_ref->vx  = XPLMFindDataRef(name))) return 0;
-        strcpy(c, "v_z");         if (!(plane_ref->vz  = XPLMFindDataRef(name))) return 0;
-        strcpy(c, "psi");         if (!(plane_ref->hdg = XPLMFindDataRef(name))) return 0;
-        strcpy(c, "gear_deploy"); if (!(plane_ref->gear= XPLMFindDataRef(name))) return 0;
-    }
-
     return -1;
 }
 
+/* Forget the aircraft, e.g. because a new one has been loaded. Stops any analysis in progress. */
 void reset_planes()
 {
+    worker_stop(&acf_worker);
+    acf_count = 0;
     plane_count = 0;
+    footprints_valid = 0;
 }
 
+
+/* Count the aircraft. When they change, kicks off acf_worker to analyse their ACF files in the background.
+ * Until it's done we use the dimensions that we had before, or defaults. */
 int count_planes()
 {
     int i;
     XPLMPluginID controller;
 
+    if (acf_count && worker_is_finished(&acf_worker))
+    {
+        /* Real dimensions have arrived */
+        for (i=0; i<acf_count; i++)
+            memcpy(plane_info + i, &acf_jobs[i].info, sizeof(plane_acf_t));
+        acf_count = 0;
+        footprints_valid = 0;
+    }
+
     if (plane_count) return plane_count;
 
     XPLMCountAircraft(&plane_count, &i, &controller);	/* Use total, cos active may increase later */
-    assert (plane_count > 0 && plane_count <= MAX_PLANES);
-    if (plane_count > MAX_PLANES) plane_count = MAX_PLANES;
+    assert (plane_count > 0);
+    if (!grow_planes(plane_count))
+    {
+        xplog("Out of memory!");
+        plane_count = plane_max;
+    }
 
     for (i=0; i<plane_count; i++)
     {
+        acf_job_t *job = acf_jobs + i;
         plane_acf_t *info = plane_info + i;
-        int o;
-        FILE *h;
-        char path[MAX_ACF_PATH];
+
+        XPLMGetNthAircraftModel(i, job->info.name, job->path);
 
         /* If we've already analysed this ACF then re-use existing data */
-        XPLMGetNthAircraftModel(i, info->name, path);
-        for (o=0; o<i; o++)
-            if (!strcmp(info->name, plane_info[o].name))
-            {
-                memcpy(info, plane_info+o, sizeof(plane_acf_t));
+        for (job->same=0; job->same<i; job->same++)
+            if (!strcmp(job->info.name, acf_jobs[job->same].info.name))
+                break;
+        if (job->same == i) job->same = -1;
+
+        if (strcmp(info->name, job->info.name))
+        {
+            /* Default values until analysed, or in case read fails - a 737-800 */
+            strcpy(info->name, job->info.name);
+            info->length = 40;
+            info->cgz = 18;
+            info->semiwidth  = 18;
+            info->refheight = 3.5;
+        }
+        memcpy(&job->info, info, sizeof(plane_acf_t));
+    }
+
+    acf_count = plane_count;
+    if (!worker_start(&acf_worker, read_planes))
+        read_planes(&acf_worker);	/* Do it ourselves */
+
+    return plane_count;
+}
+
+
+/* Find or make the cache entry for an ACF file. Returns NULL on OOM. Called from acf_worker. */
+static acf_cache_t *acf_cache_entry(const char *acfpath)
+{
+    int c;
+
+    for (c=0; c<acf_cache_count; c++)
+        if (!strcmp(acf_cache[c].path, acfpath))
+            return acf_cache + c;
+
+    if (acf_cache_count >= acf_cache_max)
+    {
+        acf_cache_t *newcache;
+        if (!(newcache = realloc(acf_cache, (acf_cache_max ? acf_cache_max * 2 : 16) * sizeof(acf_cache_t)))) return NULL;
+        acf_cache = newcache;
+        acf_cache_max = acf_cache_max ? acf_cache_max * 2 : 16;
+    }
+    memset(acf_cache + acf_cache_count, 0, sizeof(acf_cache_t));
+    strncpy(acf_cache[acf_cache_count].path, acfpath, MAX_ACF_PATH-1);
+    return acf_cache + acf_cache_count++;
+}
+
+
+/* Load our cache of previously analysed ACF files, dropping entries for ACF files that have since been changed or
+ * removed. Called from acf_worker. */
+static void load_acf_cache()
+{
+    FILE *h;
+    char path[PATH_MAX], line[MAX_ACF_PATH+128];
+
+    acf_cache_loaded = -1;
+    sprintf(path, "%s/" ACF_CACHE, pkgpath);
+    if (!(h = fopen(path, "r"))) return;
+
+    while (fgets(line, sizeof(line), h))
+    {
+        acf_cache_t *entry;
+        struct stat info;
+        long size, mtime;
+        float length, semiwidth, refheight, cgz;
+        int n;
+
+        if (sscanf(line, "%ld %ld %f %f %f %f %n", &size, &mtime, &length, &semiwidth, &refheight, &cgz, &n) < 6 ||
+            !line[n])
+        {
+            acf_cache_dirty = -1;
+            continue;	/* Corrupt */
+        }
+        line[n + strcspn(line+n, "\r\n")] = '\0';
+
+        if (stat(line+n, &info) || (long) info.st_size != size || (long) info.st_mtime != mtime)
+        {
+            acf_cache_dirty = -1;
+            continue;	/* Stale */
+        }
+
+        if (!(entry = acf_cache_entry(line+n))) break;
+        if (entry->size) acf_cache_dirty = -1;	/* Later entries in older versions of the file supersede earlier ones */
+        entry->size = size;
+        entry->mtime = mtime;
+        entry->info.length = length;
+        entry->info.semiwidth = semiwidth;
+        entry->info.refheight = refheight;
+        entry->info.cgz = cgz;
+    }
+    fclose(h);
+}
+
+
+/* Remember an analysed ACF file, replacing any previous analysis of it. Called from acf_worker. */
+static void save_acf_cache(const char *acfpath, long size, long mtime, plane_acf_t *info)
+{
+    acf_cache_t *entry;
+
+    if (!(entry = acf_cache_entry(acfpath))) return;
+    entry->size = size;
+    entry->mtime = mtime;
+    memcpy(&entry->info, info, sizeof(plane_acf_t));
+    acf_cache_dirty = -1;
+}
+
+
+/* Rewrite the whole cache file from acf_cache. Written to a temporary file first so that the cache file is never
+ * left half-written. Called from acf_worker. */
+static void write_acf_cache()
+{
+    FILE *h;
+    char path[PATH_MAX], tmppath[PATH_MAX];
+    int c;
+
+    acf_cache_dirty = 0;
+    sprintf(path, "%s/" ACF_CACHE, pkgpath);
+    sprintf(tmppath, "%s/" ACF_CACHE ".tmp", pkgpath);
+    if (!(h = fopen(tmppath, "w"))) return;
+    for (c=0; c<acf_cache_count; c++)
+        fprintf(h, "%ld %ld %f %f %f %f %s\n", acf_cache[c].size, acf_cache[c].mtime, (double) acf_cache[c].info.length, (double) acf_cache[c].info.semiwidth, (double) acf_cache[c].info.refheight, (double) acf_cache[c].info.cgz, acf_cache[c].path);
+    if (fclose(h))
+    {
+        remove(tmppath);
+        return;
+    }
+#if IBM
+    remove(path);	/* Windows won't rename over an existing file */
+#endif
+    if (rename(tmppath, path))
+        remove(tmppath);
+}
+
+
+/* Analyse the ACF files listed in acf_jobs. Runs in acf_worker. */
+static void *read_planes(void *arg)
+{
+    int i, c;
+#ifdef DO_BENCHMARK
+    char msg[64];
+    struct timeval t1, t2;
+    gettimeofday(&t1, NULL);		/* start */
+#endif
+
+    if (!acf_cache_loaded) load_acf_cache();
+
+    for (i=0; i<acf_count; i++)
+    {
+        acf_job_t *job = acf_jobs + i;
+        struct stat info;
+        FILE *h;
+        int o;
+
+        worker_check_stop(&acf_worker);
+
+        if (job->same >= 0 || !job->path[0] || stat(job->path, &info)) continue;
+
+        for (c = acf_cache_count-1; c >= 0; c--)
+            if (acf_cache[c].size == (long) info.st_size && acf_cache[c].mtime == (long) info.st_mtime && !strcmp(acf_cache[c].path, job->path))
                 break;
-            }
-        if (o<i) continue;
+        if (c >= 0)
+        {
+            job->info.length = acf_cache[c].info.length;
+            job->info.semiwidth = acf_cache[c].info.semiwidth;
+            job->info.refheight = acf_cache[c].info.refheight;
+            job->info.cgz = acf_cache[c].info.cgz;
+            continue;
+        }
 
         /* Default values in case read fails - a 737-800 */
-        info->length = 40;
-        info->cgz = 18;
-        info->semiwidth  = 18;
-        info->refheight = 3.5;
+        job->info.length = 40;
+        job->info.cgz = 18;
+        job->info.semiwidth  = 18;
+        job->info.refheight = 3.5;
 
-        if (!(h = fopen(path, "r"))) continue;
+        if (!(h = fopen(job->path, "rb"))) continue;
         o = fgetc(h);
         if (o=='I' || o=='A')
-            read_v10_plane(h, o, info);
+            read_v10_plane(h, o, &job->info);
         else if (o=='i' || o=='a')
-            read_old_plane(h, o, info);
+            read_old_plane(h, o, &job->info);
         fclose(h);
+        save_acf_cache(job->path, (long) info.st_size, (long) info.st_mtime, &job->info);
     }
 
-    return plane_count;
+    if (acf_cache_dirty) write_acf_cache();
+
+    for (i=0; i<acf_count; i++)
+        if (acf_jobs[i].same >= 0)
+            memcpy(&acf_jobs[i].info, &acf_jobs[acf_jobs[i].same].info, sizeof(plane_acf_t));
+
+#ifdef DO_BENCHMARK
+    gettimeofday(&t2, NULL);		/* stop */
+    sprintf(msg, "%d us in ACF analysis", (int) ((t2.tv_sec-t1.tv_sec) * 1000000 + t2.tv_usec - t1.tv_usec));
+    xplog(msg);
+#endif
+    worker_has_finished(&acf_worker);
+    return NULL;
 }
 
 
@@ -112,6 +355,7 @@ static void read_v10_plane(FILE *h, int platform, plane_acf_t *info)
     char line[256], *c1, *c2;
     int eol1;
     int version;
+    int found = 0;	/* Bitmask of fields that we've read */
 
     if (!fgets(line, sizeof(line), h)) return;
     if (!fgets(line, sizeof(line), h)) return;
@@ -122,42 +366,55 @@ static void read_v10_plane(FILE *h, int platform, plane_acf_t *info)
         version < 1004)
         return;	/* doesn't look like an ACF file */
 
-    while (fgets(line, sizeof(line), h))
+    while (found != 15 && fgets(line, sizeof(line), h))
     {
         /* Assume for speed that fields are single-space separated */
-        if (!strncmp(line, "P acf/_size_x ", sizeof("P acf/_size_x ")-1))
+        if (line[0] != 'P' || strncmp(line, "P acf/_", sizeof("P acf/_")-1))
+        {
+            continue;
+        }
+        else if (!strncmp(line, "P acf/_size_x ", sizeof("P acf/_size_x ")-1))
         {
             if (!sscanf(line+sizeof("P acf/_size_x ")-1, "%f", &info->semiwidth)) return;
             info->semiwidth *= 0.3048f;
+            found |= 1;
         }
         else if (!strncmp(line, "P acf/_size_z ", sizeof("P acf/_size_z ")-1))
         {
             if (!sscanf(line+sizeof("P acf/_size_z ")-1, "%f", &info->length)) return;
             info->length *= 0.3048f;
+            found |= 2;
         }
         else if (!strncmp(line, "P acf/_h_eqlbm ", sizeof("P acf/_h_eqlbm ")-1))
         {
             if (!sscanf(line+sizeof("P acf/_h_eqlbm ")-1, "%f", &info->refheight)) return;
             info->refheight *= 0.3048f;
+            found |= 4;
         }
         else if (!strncmp(line, "P acf/_cgZ ", sizeof("P acf/_cgZ ")-1))
         {
             if (!sscanf(line+sizeof("P acf/_cgZ ")-1, "%f", &info->cgz)) return;
             info->cgz *= 0.3048f;
+            found |= 8;
         }
     }
 }
 
+/* Read big-endian values */
 static size_t freadswap(void *ptr, size_t size, size_t nitems, FILE *stream)
 {
-    unsigned char *c = ptr;
-    int i, b;
+    unsigned char *c = ptr, t;
+    size_t n = fread(ptr, size, nitems, stream), i, b;
 
-    for (i=0; i<nitems; i++, c+=size)
-        for (b=size-1; b>=0; b--)
-            if (!fread(c + b, 1, 1, stream)) return i;
+    for (i=0; i<n; i++, c+=size)
+        for (b=0; b<size/2; b++)
+        {
+            t = c[b];
+            c[b] = c[size-1-b];
+            c[size-1-b] = t;
+        }
 
-    return nitems;
+    return n;
 }
 
 static void read_old_plane(FILE *h, int platform, plane_acf_t *info)
@@ -224,6 +481,7 @@ int get_plane_pos(plane_pos_t *pos, int planeno)
     float gear;
 
     assert(planeno < plane_count);
+    if (!plane_ref->x) return 0;	/* Sim doesn't publish this aircraft's position */
     if (!XPLMGetDatavf(plane_ref->gear, &gear, 0, 1) || gear!=1) return 0;	/* Not interested in airborne planes */
 
     pos->p.x = XPLMGetDataf(plane_ref->x);
@@ -240,40 +498,154 @@ int get_plane_pos(plane_pos_t *pos, int planeno)
 }
 
 
-/* Get a plane's ground footprint.
- * Returns NULL if the plane is airborne. Otherwise returns pointer to a statically allocated
- * array of 4 points, contents of which will be overwritten on next call. */
-point_t *get_plane_footprint(int planeno, float time)
+/* Another plugin has sent us its aircraft. Called from XPluginReceiveMessage(). */
+void set_ext_planes(const ext_planes_t *msg)
 {
-    static point_t p[4];	/* footprint rectangle */
-    
-    plane_pos_t pos;
-    plane_acf_t *info = plane_info + planeno;
-    float gndy, h, cosh, sinh;
-    point_t proj, tail, semi;
+    int i;
+
+    if (!msg || msg->size < (int) sizeof(ext_plane_t) || msg->count < 0 || (msg->count && !msg->planes)) return;
 
-    if (!get_plane_pos(&pos, planeno)) return NULL;
+    if (msg->count > ext_max)
+    {
+        ext_plane_t *planes;
+        plane_footprint_t *footprints;
+
+        if (!(planes = realloc(ext_planes, msg->count * sizeof(ext_plane_t))))
+        {
+            xplog("Out of memory!");
+            ext_count = 0;
+            return;
+        }
+        ext_planes = planes;
+        if (!(footprints = realloc(ext_footprints, msg->count * sizeof(plane_footprint_t))))
+        {
+            xplog("Out of memory!");
+            ext_count = 0;
+            return;
+        }
+        ext_footprints = footprints;
+        ext_max = msg->count;
+    }
+
+    /* Entries may be larger than we know about if the sender is newer than us */
+    for (i=0; i<msg->count; i++)
+        memcpy(ext_planes + i, (const char *) msg->planes + i * msg->size, sizeof(ext_plane_t));
+    ext_count = msg->count;
+    ext_ai = msg->ai;
+    ext_time = XPLMGetDataf(ref_monotonic);
+    footprints_valid = 0;
+}
 
-    gndy = pos.p.y - info->refheight;
-    h = D2R(pos.hdg);
+
+/* Planes' positions have changed, so re-read them on next call to get_plane_footprint(). Call once per frame. */
+void expire_plane_footprints()
+{
+    footprints_valid = 0;
+}
+
+
+/* Calculate the time-independent parts of a plane's footprint */
+static void make_footprint(plane_footprint_t *footprint, const plane_pos_t *pos, float length, float semiwidth, float refheight, float cgz)
+{
+    float h, cosh, sinh;
+
+    footprint->onground = -1;
+    footprint->gndy = pos->p.y - refheight;
+    h = D2R(pos->hdg);
     cosh = cosf(h);
     sinh = sinf(h);
-    if (pos.v.x || pos.v.z)
+    if (pos->v.x || pos->v.z)
     {
         /* Add space in front of plane */
-        proj.x = pos.p.x + sinh * 2 * info->cgz + time * pos.v.x;
-        proj.z = pos.p.z - cosh * 2 * info->cgz + time * pos.v.z;
+        footprint->proj.x = pos->p.x + sinh * 2 * cgz;
+        footprint->proj.z = pos->p.z - cosh * 2 * cgz;
+        footprint->v = pos->v;
     }
     else
     {
         /* unless plane is *completely* static (i.e. brake on) */
-        proj.x = pos.p.x + sinh * info->cgz;
-        proj.z = pos.p.z - cosh * info->cgz;
+        footprint->proj.x = pos->p.x + sinh * cgz;
+        footprint->proj.z = pos->p.z - cosh * cgz;
+        footprint->v.x = footprint->v.z = 0;
+    }
+    footprint->tail.x = pos->p.x - sinh * (length - cgz);
+    footprint->tail.z = pos->p.z + cosh * (length - cgz);
+    footprint->semi.x = cosh * semiwidth;
+    footprint->semi.z = sinh * semiwidth;
+}
+
+
+/* Read all planes' positions and calculate the time-independent parts of their footprints.
+ * Aircraft supplied by another plugin follow the sim's aircraft. */
+static void snapshot_planes()
+{
+    int planeno, count = count_planes(), ext = ext_count;
+
+    if (ext && XPLMGetDataf(ref_monotonic) - ext_time > EXT_PLANES_TIMEOUT)
+        ext = ext_count = 0;	/* Sender has stopped sending */
+    if (ext && ext_ai && count > 1)
+        count = 1;		/* Sender supplies the AI aircraft, so just read the user's */
+
+    for (planeno=0; planeno<count; planeno++)
+    {
+        plane_footprint_t *footprint = plane_footprints + planeno;
+        plane_acf_t *info = plane_info + planeno;
+        plane_pos_t pos;
+
+        if ((footprint->onground = get_plane_pos(&pos, planeno)))
+            make_footprint(footprint, &pos, info->length, info->semiwidth, info->refheight, info->cgz);
+    }
+
+    for (planeno=0; planeno<ext; planeno++)
+    {
+        ext_plane_t *plane = ext_planes + planeno;
+        plane_pos_t pos;
+
+        pos.p.x = plane->x;
+        pos.p.y = plane->y;
+        pos.p.z = plane->z;
+        pos.v.x = plane->vx;
+        pos.v.y = 0;
+        pos.v.z = plane->vz;
+        pos.hdg = plane->hdg;
+        make_footprint(ext_footprints + planeno, &pos, plane->length, plane->semiwidth, plane->refheight, plane->cgz);
     }
-    tail.x = pos.p.x - sinh * (info->length - info->cgz);
-    tail.z = pos.p.z + cosh * (info->length - info->cgz);
-    semi.x = cosh * info->semiwidth;
-    semi.z = sinh * info->semiwidth;
+
+    footprint_sim = count;
+    footprint_count = count + ext;
+    footprints_valid = -1;
+}
+
+
+/* Number of plane footprints available from get_plane_footprint() this frame */
+int count_footprints()
+{
+    if (!footprints_valid) snapshot_planes();
+    return footprint_count;
+}
+
+
+/* Get a plane's ground footprint, projected time [s] into the future. planeno < count_footprints().
+ * Positions are read at most once per frame - see expire_plane_footprints().
+ * Returns NULL if the plane is airborne. Otherwise returns pointer to a statically allocated
+ * array of 4 points, contents of which will be overwritten on next call. */
+point_t *get_plane_footprint(int planeno, float time)
+{
+    static point_t p[4];	/* footprint rectangle */
+
+    plane_footprint_t *footprint;
+    float gndy;
+    point_t proj, tail, semi;
+
+    if (!footprints_valid) snapshot_planes();
+    footprint = planeno < footprint_sim ? plane_footprints + planeno : ext_footprints + (planeno - footprint_sim);
+    if (!footprint->onground) return NULL;
+
+    gndy = footprint->gndy;
+    proj.x = footprint->proj.x + time * footprint->v.x;
+    proj.z = footprint->proj.z + time * footprint->v.z;
+    tail = footprint->tail;
+    semi = footprint->semi;
 
     p[0].x = proj.x - semi.x;  p[0].y = gndy;  p[0].z = proj.z - semi.z;
     p[1].x = proj.x + semi.x;  p[1].y = gndy;  p[1].z = proj.z + semi.z;
@@ -14,9 +14,11 @@ typedef __int32 int32_t;
 
 #include "groundtraffic.h"
 
-#define MAX_PLANES 20		/* Seems to be a hard-coded limit in X-Plane, but maybe could increase in future */
 #define MAX_ACF_NAME 256
 #define MAX_ACF_PATH 512
+#define ACF_CACHE "groundtraffic_acf.txt"	/* Dimensions of previously analysed ACF files, in our package folder */
+#define MSG_EXT_PLANES 0x47540001	/* Inter-plugin message through which another plugin supplies aircraft - see ext_planes_t */
+#define EXT_PLANES_TIMEOUT 1.f		/* Forget externally supplied aircraft if not refreshed within this time [s] */
 
 typedef struct
 {
@@ -29,12 +31,56 @@ typedef struct
     float hdg;			/* [degrees] */
 } plane_pos_t;
 
+/* Ground footprint of a plane, snapshotted once per frame */
+typedef struct
+{
+    int onground;		/* Footprint is only valid if plane is on the ground */
+    float gndy;
+    point_t proj, tail, semi;	/* Footprint at time 0 - front and rear centre, and half-width */
+    point_t v;			/* Speed [m/s] to project footprint forwards, or 0 if plane is static */
+} plane_footprint_t;
+
 typedef struct
 {
     char name[MAX_ACF_NAME];
     float length, semiwidth, refheight, cgz;	/* dimensions [m] */
 } plane_acf_t;
 
+/* An aircraft's ACF file to be analysed in the background */
+typedef struct
+{
+    char path[MAX_ACF_PATH];
+    plane_acf_t info;
+    int same;			/* Index of an earlier job for the same ACF file, or -1 */
+} acf_job_t;
+
+/* A previously analysed ACF file */
+typedef struct
+{
+    char path[MAX_ACF_PATH];
+    long size, mtime;		/* The ACF file's, at the time it was analysed */
+    plane_acf_t info;		/* Only dimensions are valid */
+} acf_cache_t;
+
+/* An aircraft supplied by another plugin. Position and speed are in local OpenGL co-ordinates. */
+typedef struct
+{
+    float x, y, z;		/* Position [m] */
+    float vx, vz;		/* Speed [m/s] */
+    float hdg;			/* True heading [degrees] */
+    float length, semiwidth, refheight, cgz;	/* dimensions [m], as for plane_acf_t */
+} ext_plane_t;
+
+/* Parameter of the MSG_EXT_PLANES message. Another plugin broadcasts this each frame with
+ * XPLMSendMessageToPlugin(XPLM_NO_PLUGIN_ID, MSG_EXT_PLANES, &msg). The aircraft are copied during the call. */
+typedef struct
+{
+    int size;			/* sizeof(ext_plane_t), so that fields can be added later */
+    int count;			/* Number of aircraft, all of which are on the ground */
+    int ai;			/* Non-zero if these include the sim's AI aircraft, so we needn't read their DataRefs */
+    const ext_plane_t *planes;
+} ext_planes_t;
+
 
 /* prototypes */
 int setup_plane_refs();
@@ -42,4 +88,7 @@ void reset_planes();
 int count_planes();
 plane_acf_t *get_plane_info(int planeno);
 int get_plane_pos(plane_pos_t *pos, int planeno);
+void set_ext_planes(const ext_planes_t *msg);
+void expire_plane_footprints();
+int count_footprints();
 point_t *get_plane_footprint(int planeno, float time);
@@ -65,16 +65,9 @@ void clearconfig(airport_t *airport)
             int i;
             for (i=0; i<route->pathlen; i++)
             {
-                collision_t *collision = route->path[i].collisions;
                 setcmd_t    *setcmd    = route->path[i].setcmds;
                 whenref_t   *whenref   = route->path[i].whenrefs;
 
-                while (collision)
-                {
-                    collision_t *next = collision->next;
-                    free (collision);
-                    collision = next;
-                }
                 while (setcmd)
                 {
                     setcmd_t *next = setcmd->next;
@@ -87,6 +80,7 @@ void clearconfig(airport_t *airport)
                     free (whenref);
                     whenref = next;
                 }
+                free(route->path[i].attime);
             }
             free(route->path);
             free(route->varrefs);
@@ -96,10 +90,11 @@ void clearconfig(airport_t *airport)
         }
         free(route->object.name);
         free(route->object.physical_name);
-        free(route);
+        if (!airport->routetbl) free(route);	/* Else freed below */
         route = nextroute;
     }
-    airport->routes = airport->firstroute = NULL;
+    free(airport->routetbl);
+    airport->routes = airport->routetbl = airport->firstroute = NULL;
 
     train = airport->trains;
     while (train)
@@ -135,8 +130,27 @@ void clearconfig(airport_t *airport)
     }
     airport->extrefs = NULL;
 
+    free(airport->conflicts);
+    airport->conflicts = NULL;
+    free(airport->zones);
+    airport->zones = NULL;
+    free(airport->segmentgrid.plane_time);
+    airport->segmentgrid.plane_time = NULL;
+
     free(airport->drawinfo);
-    airport->drawinfo = NULL;
+    free(airport->lastdrawinfo);
+    free(airport->framedrawinfo);
+    airport->drawinfo = airport->lastdrawinfo = airport->framedrawinfo = NULL;
+    airport->routecount = 0;
+    free(airport->events);
+    free(airport->due);
+    airport->events = airport->due = NULL;
+    airport->eventcount = 0;
+    free(airport->moving);
+    free(airport->woken);
+    free(airport->children);
+    airport->moving = airport->woken = airport->children = NULL;
+    airport->movingcount = airport->wokencount = 0;
 
     free(labeltbl);
     labeltbl = NULL;
@@ -352,8 +366,10 @@ int readconfig(char *pkgpath, airport_t *airport)
 
                 if (!node)
                     return failconfig(h, airport, buffer, "Route can't start with an \"at\" command at line %d", lineno);
-                else if (node->attime[0] != INVALID_AT)
+                else if (node->attime)
                     return failconfig(h, airport, buffer, "Waypoint can't have more than one \"at\" command at line %d", lineno);
+                else if (!(node->attime = calloc(1, sizeof(attime_t))))
+                    return failconfig(h, airport, buffer, "Out of memory!");
                 while ((c1=strtok(NULL, sep)))
                 {
                     if (!strcasecmp(c1, "on"))
@@ -362,22 +378,22 @@ int readconfig(char *pkgpath, airport_t *airport)
                         return failconfig(h, airport, buffer, "Exceeded %d times-of-day at line %d", MAX_ATTIMES, lineno);
                     else if (sscanf(c1, "%d:%d%n", &hour, &minute, &eol1)!=2 || c1[eol1] || hour<0 || hour>23 || minute<0 || minute>59)
                         return failconfig(h, airport, buffer, "Expecting a time-of-day \"HH:MM\" or \"on\", found \"%s\" at line %d", c1, lineno);
-                    node->attime[i++] = hour*60+minute;
+                    node->attime->times[i++] = hour*60+minute;
                 }
-                if (i<MAX_ATTIMES) node->attime[i] = INVALID_AT;	/* Terminate */
+                if (i<MAX_ATTIMES) node->attime->times[i] = INVALID_AT;	/* Terminate */
 
                 while ((c1=strtok(NULL, sep)))
                 {
                     for (i=0; i<7; i++)
                         if (!strncasecmp(c1, daynames[i], strlen(c1)))
                         {
-                            node->atdays |= dayvals[i];
+                            node->attime->days |= dayvals[i];
                             break;
                         }
                     if (i>=7)
                         return failconfig(h, airport, buffer, "Expecting a day name, found \"%s\" at line %d", c1, lineno);
                 }
-                if (!node->atdays) node->atdays = DAY_ALL;
+                if (!node->attime->days) node->attime->days = DAY_ALL;
             }
             else if (!currentroute->highway && (!strcasecmp(c1, "when") || !strcasecmp(c1, "and")))
             {
@@ -497,7 +513,7 @@ int readconfig(char *pkgpath, airport_t *airport)
                 node = path + currentroute->pathlen;
                 last = node - 1;
                 memset(node, 0, sizeof(path_t));
-                node->attime[0] = INVALID_AT;
+                node->segment_zone = node->node_zone = -1;	/* Not in any conflict zone until check_collisions() says so */
                 if (!currentroute->highway) c2=strtok(NULL, sep);	/* done above for highways */
                 if (!c1 || !sscanf(c1, "%f%n", &node->waypoint.lat, &eol1) || c1[eol1] ||
                     !c2 || !sscanf(c2, "%f%n", &node->waypoint.lon, &eol2) || c2[eol2])